@@ -0,0 +1,375 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parser.h"
+
+// one parsed object, pointing into the caller's bytes where it can
+typedef struct object_module {
+	int globals;
+	int main_start;
+	int export_count;
+	const unsigned char *exports;
+	int external_count;
+	const unsigned char *externals;
+	int relocation_count;
+	const unsigned char *relocations;
+	int code_length;
+	const unsigned char *code;
+	// where its procedures and its share of main's frame end up
+	int code_base;
+	int global_base;
+} object_module;
+
+typedef struct object_reader {
+	const unsigned char *data;
+	long length;
+	long position;
+	bool failed;
+} object_reader;
+
+bool read_object(const unsigned char *data, long length, object_module *module);
+int read_int32(object_reader *reader);
+const unsigned char *read_block(object_reader *reader, int count, int element_size);
+int int32_at(const unsigned char *bytes, int index);
+void name_at(const unsigned char *names, int stride, int index, char name[]);
+bool has_main_body(const object_module *module);
+int linked_index(const object_module *module, bool entry, int main_base, int index);
+int find_export(const object_module *modules, int count, const char *name);
+int export_index(const object_module *module, int export);
+
+// links count objects into one program, see parser.h
+link_status link_objects(const unsigned char *const *objects, const long *lengths, int count, 
+	link_result *result)
+{
+	object_module *modules = calloc(count > 0 ? count : 1, sizeof(object_module));
+	object_module *module;
+	instruction *code;
+	int *resolved;
+	char name[IDENTIFIER_LENGTH];
+	link_status status = link_ok;
+	int entry = -1;
+	int main_base;
+	int length = 1;
+	int globals = 0;
+	int index;
+	int target;
+	int kind;
+	int i;
+	int j;
+
+	result->code = NULL;
+	result->code_length = 0;
+	result->symbol[0] = '\0';
+	if (modules == NULL)
+		return link_out_of_memory;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!read_object(objects[i], lengths[i], &modules[i]))
+		{
+			free(modules);
+			return link_bad_object;
+		}
+		if (has_main_body(&modules[i]))
+		{
+			if (entry != -1)
+			{
+				free(modules);
+				return link_multiple_mains;
+			}
+			entry = i;
+		}
+	}
+	if (entry == -1)
+	{
+		free(modules);
+		return link_no_main;
+	}
+
+	// every module's procedures in order after the JMP, then the entry's main
+	for (i = 0; i < count; i++)
+	{
+		modules[i].code_base = length;
+		modules[i].global_base = globals;
+		length += modules[i].main_start - 1;
+		globals += modules[i].globals;
+	}
+	main_base = length;
+	length += modules[entry].code_length - modules[entry].main_start;
+
+	// two modules can't export the same name
+	for (i = 0; i < count && status == link_ok; i++)
+		for (j = 0; j < modules[i].export_count && status == link_ok; j++)
+		{
+			name_at(modules[i].exports, IDENTIFIER_LENGTH + 4, j, name);
+			if (find_export(modules, i, name) != -1)
+			{
+				strcpy(result->symbol, name);
+				status = link_duplicate_symbol;
+			}
+		}
+	if (status != link_ok)
+	{
+		free(modules);
+		return status;
+	}
+
+	code = malloc(length * sizeof(instruction));
+	if (code == NULL)
+	{
+		free(modules);
+		return link_out_of_memory;
+	}
+	code[0].op = JMP;
+	code[0].l = 0;
+	code[0].m = main_base * 3;
+	for (i = 0; i < count; i++)
+	{
+		module = &modules[i];
+		for (j = 1; j < module->code_length; j++)
+		{
+			index = linked_index(module, i == entry, main_base, j);
+			if (index == -1)
+				continue;
+			code[index].op = int32_at(module->code, j * 3);
+			code[index].l = int32_at(module->code, j * 3 + 1);
+			code[index].m = int32_at(module->code, j * 3 + 2);
+		}
+	}
+
+	// patch every relocation that landed in the linked code, each module's 
+	// externals are looked up once
+	for (i = 0; i < count && status == link_ok; i++)
+	{
+		module = &modules[i];
+		resolved = malloc((module->external_count + 1) * sizeof(int));
+		if (resolved == NULL)
+		{
+			status = link_out_of_memory;
+			break;
+		}
+		for (j = 0; j < module->external_count; j++)
+		{
+			name_at(module->externals, IDENTIFIER_LENGTH, j, name);
+			resolved[j] = find_export(modules, count, name);
+		}
+		for (j = 0; j < module->relocation_count && status == link_ok; j++)
+		{
+			index = linked_index(module, i == entry, main_base, int32_at(module->relocations, j * 3));
+			kind = int32_at(module->relocations, j * 3 + 1);
+			if (index == -1)
+				continue;
+			if (kind == relocate_code)
+			{
+				target = code[index].m / 3 < module->code_length ? 
+					linked_index(module, i == entry, main_base, code[index].m / 3) : -1;
+				if (target == -1)
+					status = link_bad_object;
+				else
+					code[index].m = target * 3;
+			}
+			else if (kind == relocate_external)
+			{
+				target = resolved[int32_at(module->relocations, j * 3 + 2)];
+				if (target == -1)
+				{
+					name_at(module->externals, IDENTIFIER_LENGTH, int32_at(module->relocations, j * 3 + 2), 
+						result->symbol);
+					status = link_unresolved_symbol;
+				}
+				else
+					code[index].m = target * 3;
+			}
+			else
+				code[index].m += module->global_base;
+		}
+		free(resolved);
+	}
+
+	// main's frame holds every module's globals
+	if (code[main_base].op == INC)
+		code[main_base].m = 3 + globals;
+
+	free(modules);
+	if (status != link_ok)
+	{
+		free(code);
+		return status;
+	}
+	result->code = code;
+	result->code_length = length;
+	return link_ok;
+}
+
+const char *link_status_message(link_status status)
+{
+	switch (status)
+	{
+		case link_ok :
+			return "linked";
+		case link_bad_object :
+			return "Link Error: not a valid object";
+		case link_duplicate_symbol :
+			return "Link Error: procedure defined in more than one module";
+		case link_unresolved_symbol :
+			return "Link Error: call to a procedure no module defines";
+		case link_no_main :
+			return "Link Error: no module has a main program";
+		case link_multiple_mains :
+			return "Link Error: more than one module has a main program";
+		case link_out_of_memory :
+			return "Link Error: out of memory";
+		default :
+			return "Implementation Error: unrecognized status";
+	}
+}
+
+// checks the header and that every count and index stays inside the object, 
+// 		the sections are left in place and read with int32_at()
+bool read_object(const unsigned char *data, long length, object_module *module)
+{
+	object_reader reader = { data, length, 4, false };
+	int index;
+	int i;
+
+	if (length < 4 || memcmp(data, OBJECT_MAGIC, 4) != 0 || read_int32(&reader) != OBJECT_VERSION)
+		return false;
+	module->globals = read_int32(&reader);
+	module->main_start = read_int32(&reader);
+	module->export_count = read_int32(&reader);
+	module->exports = read_block(&reader, module->export_count, IDENTIFIER_LENGTH + 4);
+	module->external_count = read_int32(&reader);
+	module->externals = read_block(&reader, module->external_count, IDENTIFIER_LENGTH);
+	module->relocation_count = read_int32(&reader);
+	module->relocations = read_block(&reader, module->relocation_count, 12);
+	module->code_length = read_int32(&reader);
+	module->code = read_block(&reader, module->code_length, 12);
+	if (reader.failed || module->globals < 0 || module->main_start < 1 || 
+		module->main_start >= module->code_length)
+		return false;
+
+	for (i = 0; i < module->export_count; i++)
+	{
+		index = export_index(module, i);
+		if (index < 1 || index >= module->main_start)
+			return false;
+	}
+	for (i = 0; i < module->relocation_count; i++)
+	{
+		index = int32_at(module->relocations, i * 3);
+		if (index < 1 || index >= module->code_length)
+			return false;
+		switch (int32_at(module->relocations, i * 3 + 1))
+		{
+			case relocate_code :
+				if (int32_at(module->code, index * 3 + 2) < 0)
+					return false;
+				break;
+			case relocate_external :
+				if (int32_at(module->relocations, i * 3 + 2) < 0 || 
+					int32_at(module->relocations, i * 3 + 2) >= module->external_count)
+					return false;
+				break;
+			case relocate_global :
+				break;
+			default :
+				return false;
+		}
+	}
+	return true;
+}
+
+int read_int32(object_reader *reader)
+{
+	int value;
+
+	if (reader->position + 4 > reader->length)
+	{
+		reader->failed = true;
+		return 0;
+	}
+	value = int32_at(reader->data + reader->position, 0);
+	reader->position += 4;
+	return value;
+}
+
+// skips over count elements, NULL if they don't fit in what is left
+const unsigned char *read_block(object_reader *reader, int count, int element_size)
+{
+	const unsigned char *block = reader->data + reader->position;
+
+	if (count < 0 || (long) count * element_size > reader->length - reader->position)
+	{
+		reader->failed = true;
+		return NULL;
+	}
+	reader->position += (long) count * element_size;
+	return block;
+}
+
+// the little endian int32 at bytes + index * 4
+int int32_at(const unsigned char *bytes, int index)
+{
+	const unsigned char *at = bytes + (long) index * 4;
+	return (int) ((uint32_t) at[0] | (uint32_t) at[1] << 8 | (uint32_t) at[2] << 16 | (uint32_t) at[3] << 24);
+}
+
+// copies the index-th name out of a section with entries stride bytes apart
+void name_at(const unsigned char *names, int stride, int index, char name[])
+{
+	memcpy(name, names + (long) index * stride, IDENTIFIER_LENGTH);
+	name[IDENTIFIER_LENGTH - 1] = '\0';
+}
+
+// a main that is more than its INC and HLT
+bool has_main_body(const object_module *module)
+{
+	int op;
+	int i;
+
+	for (i = module->main_start; i < module->code_length; i++)
+	{
+		op = int32_at(module->code, i * 3);
+		if (op != INC && !(op == SYS && int32_at(module->code, i * 3 + 2) == HLT))
+			return true;
+	}
+	return false;
+}
+
+// where instruction index of a module goes in the linked code, -1 for the 
+// 		module's own JMP and for main in every module but the entry
+int linked_index(const object_module *module, bool entry, int main_base, int index)
+{
+	if (index < 1)
+		return -1;
+	if (index < module->main_start)
+		return module->code_base + index - 1;
+	return entry ? main_base + index - module->main_start : -1;
+}
+
+// the linked instruction index of the first export called name, -1 if no 
+// 		module exports it
+int find_export(const object_module *modules, int count, const char *name)
+{
+	char export_name[IDENTIFIER_LENGTH];
+	int i;
+	int j;
+
+	for (i = 0; i < count; i++)
+		for (j = 0; j < modules[i].export_count; j++)
+		{
+			name_at(modules[i].exports, IDENTIFIER_LENGTH + 4, j, export_name);
+			if (strcmp(export_name, name) == 0)
+				return modules[i].code_base + export_index(&modules[i], j) - 1;
+		}
+	return -1;
+}
+
+// the instruction index in its own module the export-th export starts at
+int export_index(const object_module *module, int export)
+{
+	return int32_at(module->exports + (long) export * (IDENTIFIER_LENGTH + 4) + IDENTIFIER_LENGTH, 0);
+}
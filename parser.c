@@ -2,69 +2,563 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
-
-#define ARRAY_SIZE 500
-
-typedef enum token_type {
-	identifier = 1, number, keyword_const, keyword_var, keyword_procedure,
-	keyword_call, keyword_begin, keyword_end, keyword_if, keyword_then,
-	keyword_else, keyword_while, keyword_do, keyword_read, keyword_write,
-	keyword_def, period, assignment_symbol, minus, semicolon,
-	left_curly_brace, right_curly_brace, equal_to, not_equal_to, less_than,
-	less_than_or_equal_to, greater_than, greater_than_or_equal_to, plus, times,
-	division, left_parenthesis, right_parenthesis
-} token_type;
-
-typedef enum opcode_name {
-	LIT = 1, OPR = 2, LOD = 3, STO = 4, CAL = 5, INC = 6, JMP = 7, JPC = 8, 
-	SYS = 9, WRT = 1, RED = 2, HLT = 3, 
-	RTN = 0, ADD = 1, SUB = 2, MUL = 3, DIV = 4, EQL = 5, NEQ = 6,
-	LSS = 7, LEQ = 8, GTR = 9, GEQ = 10
-} opcode_name;
-
-typedef struct lexeme {
-	token_type type;
-	char identifier_name[12];
-	int number_value;
-	int error_type;
-} lexeme;
-
-typedef struct instruction {
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "parser.h"
+
+// the parser builds this instead of emitting code directly: every procedure 
+// is a list of basic blocks and every block a run of nodes. a node is a 
+// future instruction, except that LOD, STO and CAL still name a symbol and 
+// JMP and JPC name a block. a procedure's code starts where the one before 
+// it ended, and once it is finished and everything it calls has an address 
+// lower_procedure() resolves both into PAS code
+typedef struct ir_node {
 	int op;
 	int l;
 	int m;
-} instruction;
-
-typedef struct symbol {
-	int kind;
-	char name[12];
-	int value;
-	int level;
+	int symbol;
+	int source;
+} ir_node;
+
+// a block falls through to the next block unless it ends in a JMP, RTN or 
+// HLT, branch is the block a JMP or JPC at its end goes to
+typedef struct ir_block {
+	int first_node;
+	int node_count;
+	int fallthrough;
+	int branch;
 	int address;
-	int mark;
-} symbol;
+} ir_block;
 
-lexeme *tokens;
-int token_index = 0;
-symbol *table;
-int table_index = 0;
-instruction *code;
-int code_index = 0;
-
-int error = 0;
-int level;
+// procedures are kept in the order their code starts, which puts nested 
+// procedures before the ones they are declared in
+typedef struct ir_procedure {
+	int symbol;
+	int level;
+	int first_block;
+	int block_count;
+	int source;
+} ir_procedure;
+
+// where code came from: a statement, or with block set a procedure's whole 
+// block, which is what its INC and RTN are charged to. nodes carry the 
+// source they were emitted under and every instruction keeps it in 
+// code_sources, -1 for the JMP to main and linked code
+typedef struct source_range {
+	int first_token;
+	int last_token;
+	int procedure;
+	bool block;
+} source_range;
+
+// an arithmetic expression as parsed, kept as a tree until all of it is 
+// read so it can be folded and reordered before any code is emitted. op is 
+// LIT (m is the value), LOD (symbol is the variable) or OPR (m is ADD to DIV 
+// of left and right). depth is how many stack cells its code needs and 
+// can_fail is set when it divides by something that could be 0
+typedef struct expression_node {
+	int op;
+	int m;
+	int symbol;
+	int left;
+	int right;
+	int depth;
+	bool can_fail;
+} expression_node;
+
+// bounded single producer, single consumer ring that connects the stages of 
+// a pipelined compilation. head and tail only grow, each side writes its own 
+// and reads the other's, so neither ever takes a lock. a side that has to 
+// wait spins briefly and then yields its cpu
+typedef struct stage_queue {
+	char *slots;
+	size_t element_size;
+	uint32_t capacity;
+	_Atomic uint32_t head;
+	_Atomic uint32_t tail;
+	_Atomic bool closed;
+} stage_queue;
+
+#define STAGE_QUEUE_CAPACITY 4096
+#define STAGE_BATCH 256
+
+_Thread_local lexeme *tokens;
+_Thread_local int token_index = 0;
+_Thread_local int token_count = 0;
+_Thread_local int token_capacity = 0;
+_Thread_local int *number_pool;
+_Thread_local int number_count = 0;
+_Thread_local int number_capacity = 0;
+_Thread_local symbol *table;
+_Thread_local int table_index = 0;
+_Thread_local int table_capacity = 0;
+_Thread_local instruction *code;
+_Thread_local int code_index = 0;
+_Thread_local int code_capacity = 0;
+_Thread_local int *code_sources;
+_Thread_local int code_source_capacity = 0;
+
+_Thread_local source_range *sources;
+_Thread_local int source_count = 0;
+_Thread_local int source_capacity = 0;
+_Thread_local int current_source = -1;
+_Thread_local source_span *source_map;
+_Thread_local int source_map_length = 0;
+
+_Thread_local ir_node *ir_nodes;
+_Thread_local int ir_node_count = 0;
+_Thread_local int ir_node_capacity = 0;
+_Thread_local ir_block *ir_blocks;
+_Thread_local int ir_block_count = 0;
+_Thread_local int ir_block_capacity = 0;
+_Thread_local ir_procedure *ir_procedures;
+_Thread_local int ir_procedure_count = 0;
+_Thread_local int ir_procedure_capacity = 0;
+_Thread_local int ir_lowered_count = 0;
+_Thread_local int ir_next_address = 1;
+
+_Thread_local expression_node *expression_nodes;
+_Thread_local int expression_node_count = 0;
+_Thread_local int expression_node_capacity = 0;
+
+_Thread_local lexeme_summary lexeme_info;
+
+_Thread_local diagnostic *diagnostics;
+_Thread_local int diagnostic_count = 0;
+_Thread_local int diagnostic_capacity = 0;
+
+// set while this thread is a pipeline stage: the lexer sends lexemes to 
+// token_sink (numbers carry their value instead of a pool index), the parser 
+// pulls them from token_source when it reads past the last one it has, and 
+// every lowered procedure goes to code_sink
+_Thread_local stage_queue *token_sink;
+_Thread_local stage_queue *token_source;
+_Thread_local stage_queue *code_sink;
+_Thread_local lexeme sink_batch[STAGE_BATCH];
+_Thread_local int sink_batch_count = 0;
+
+_Thread_local int error = 0;
+_Thread_local int level;
+_Thread_local int max_stack_depth = 0;
+
+// optimization settings, they outlive each compilation
+_Thread_local int optimizations = 0;
+_Thread_local int inline_limit = DEFAULT_INLINE_LIMIT;
+_Thread_local bool module_mode = false;
+
+// procedures a module calls without declaring them, in the order they were 
+// first called. their CALs carry -3 * (index + 1) until the linker resolves them
+_Thread_local char (*external_names)[IDENTIFIER_LENGTH];
+_Thread_local int external_count = 0;
+_Thread_local int external_capacity = 0;
+
+// identifiers are interned once for the whole process, so an id means the 
+// same name on every thread and each name is stored once. the hash table is a 
+// chain of levels, each twice the size of the one before, and a name lives in 
+// the first level that had a free slot among its INTERN_PROBES probes. slots 
+// are filled once and never change, which is what lets lookups and inserts 
+// go without locks: a slot holds the name's hash in its high half and id + 1 
+// in its low half and is published with a compare and swap after the name 
+// has been written. names sit in chunks that never move
+#define INTERN_FIRST_LEVEL 1024
+#define INTERN_PROBES 16
+#define INTERN_CHUNK_SIZE 4096
+#define INTERN_CHUNKS 65536
+
+typedef struct intern_level {
+	_Atomic(struct intern_level *) next;
+	uint32_t mask;
+	_Atomic uint64_t slots[];
+} intern_level;
+
+_Atomic(intern_level *) intern_levels;
+_Atomic uint32_t intern_count;
+_Atomic(char (*)[IDENTIFIER_LENGTH]) intern_chunks[INTERN_CHUNKS];
+
+// per-compilation memory comes from a bump arena that begin_compilation() 
+// resets in one step, the blocks stay around so later compilations reuse them
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t capacity;
+	char data[];
+} arena_block;
+
+typedef struct arena {
+	arena_block *first;
+	arena_block *current;
+	size_t used;
+	size_t used_before_current;
+	void *last_allocation;
+	allocation_stats stats;
+} arena;
+
+_Thread_local arena compile_arena;
+
+// where a compilation that runs out of memory jumps back to, NULL outside one
+_Thread_local jmp_buf *allocation_recovery = NULL;
+
+// one begin or end of a traced phase, procedure is empty for end events and 
+// phases that aren't about one procedure
+typedef struct trace_event {
+	const char *name;
+	char procedure[IDENTIFIER_LENGTH];
+	int level;
+	char phase;
+	long long time;
+} trace_event;
+
+// a thread's events, every buffer stays on the trace_buffers list so 
+// write_trace() still finds them after their thread is gone
+typedef struct trace_buffer {
+	struct trace_buffer *next;
+	int thread;
+	int count;
+	long dropped;
+	trace_event events[];
+} trace_buffer;
+
+bool tracing = false;
+_Atomic(trace_buffer *) trace_buffers;
+_Atomic int trace_threads;
+_Thread_local trace_buffer *thread_trace;
+
+// one compiled procedure: its symbol and the code it occupies, from its INC 
+// to the closing RTN (HLT for main), inclusive
+typedef struct procedure_range {
+	int symbol;
+	int first;
+	int last;
+} procedure_range;
+
+// lexer dfa states, 0 means there is no transition and the token ends
+enum lexer_state {
+	LS_NONE, LS_START, LS_IDENTIFIER, LS_NUMBER, LS_COLON, LS_ASSIGN, 
+	LS_LESS, LS_LESS_EQUAL, LS_NOT_EQUAL, LS_GREATER, LS_GREATER_EQUAL, 
+	LS_SLASH, LS_COMMENT, LS_COMMENT_STAR, LS_COMMENT_END, LS_SINGLE, 
+	LS_STATE_COUNT
+};
+
+// lexer character classes
+enum lexer_class {
+	LC_OTHER, LC_LETTER, LC_DIGIT, LC_SPACE, LC_COLON, LC_EQUAL, LC_LESS, 
+	LC_GREATER, LC_SLASH, LC_STAR, LC_PUNCT, LC_CLASS_COUNT
+};
+
+// the class of every byte, anything not listed is LC_OTHER
+const unsigned char char_class[256] = {
+	['a'] = LC_LETTER, ['b'] = LC_LETTER, ['c'] = LC_LETTER, ['d'] = LC_LETTER, ['e'] = LC_LETTER, 
+	['f'] = LC_LETTER, ['g'] = LC_LETTER, ['h'] = LC_LETTER, ['i'] = LC_LETTER, ['j'] = LC_LETTER, 
+	['k'] = LC_LETTER, ['l'] = LC_LETTER, ['m'] = LC_LETTER, ['n'] = LC_LETTER, ['o'] = LC_LETTER, 
+	['p'] = LC_LETTER, ['q'] = LC_LETTER, ['r'] = LC_LETTER, ['s'] = LC_LETTER, ['t'] = LC_LETTER, 
+	['u'] = LC_LETTER, ['v'] = LC_LETTER, ['w'] = LC_LETTER, ['x'] = LC_LETTER, ['y'] = LC_LETTER, 
+	['z'] = LC_LETTER, 
+	['A'] = LC_LETTER, ['B'] = LC_LETTER, ['C'] = LC_LETTER, ['D'] = LC_LETTER, ['E'] = LC_LETTER, 
+	['F'] = LC_LETTER, ['G'] = LC_LETTER, ['H'] = LC_LETTER, ['I'] = LC_LETTER, ['J'] = LC_LETTER, 
+	['K'] = LC_LETTER, ['L'] = LC_LETTER, ['M'] = LC_LETTER, ['N'] = LC_LETTER, ['O'] = LC_LETTER, 
+	['P'] = LC_LETTER, ['Q'] = LC_LETTER, ['R'] = LC_LETTER, ['S'] = LC_LETTER, ['T'] = LC_LETTER, 
+	['U'] = LC_LETTER, ['V'] = LC_LETTER, ['W'] = LC_LETTER, ['X'] = LC_LETTER, ['Y'] = LC_LETTER, 
+	['Z'] = LC_LETTER, 
+	['0'] = LC_DIGIT, ['1'] = LC_DIGIT, ['2'] = LC_DIGIT, ['3'] = LC_DIGIT, ['4'] = LC_DIGIT, 
+	['5'] = LC_DIGIT, ['6'] = LC_DIGIT, ['7'] = LC_DIGIT, ['8'] = LC_DIGIT, ['9'] = LC_DIGIT, 
+	[' '] = LC_SPACE, ['\t'] = LC_SPACE, ['\n'] = LC_SPACE, ['\r'] = LC_SPACE, ['\v'] = LC_SPACE, 
+	['\f'] = LC_SPACE, [':'] = LC_COLON, ['='] = LC_EQUAL, ['<'] = LC_LESS, ['>'] = LC_GREATER, 
+	['/'] = LC_SLASH, ['*'] = LC_STAR, ['.'] = LC_PUNCT, ['-'] = LC_PUNCT, [';'] = LC_PUNCT, 
+	['{'] = LC_PUNCT, ['}'] = LC_PUNCT, ['+'] = LC_PUNCT, ['('] = LC_PUNCT, [')'] = LC_PUNCT
+};
+
+const unsigned char lexer_table[LS_STATE_COUNT][LC_CLASS_COUNT] = {
+	[LS_START] = {
+		[LC_LETTER] = LS_IDENTIFIER, [LC_DIGIT] = LS_NUMBER, [LC_COLON] = LS_COLON, 
+		[LC_EQUAL] = LS_SINGLE, [LC_LESS] = LS_LESS, [LC_GREATER] = LS_GREATER, 
+		[LC_SLASH] = LS_SLASH, [LC_STAR] = LS_SINGLE, [LC_PUNCT] = LS_SINGLE
+	},
+	[LS_IDENTIFIER] = { [LC_LETTER] = LS_IDENTIFIER, [LC_DIGIT] = LS_IDENTIFIER },
+	[LS_NUMBER] = { [LC_DIGIT] = LS_NUMBER },
+	[LS_COLON] = { [LC_EQUAL] = LS_ASSIGN },
+	[LS_LESS] = { [LC_EQUAL] = LS_LESS_EQUAL, [LC_GREATER] = LS_NOT_EQUAL },
+	[LS_GREATER] = { [LC_EQUAL] = LS_GREATER_EQUAL },
+	[LS_SLASH] = { [LC_STAR] = LS_COMMENT },
+	[LS_COMMENT] = {
+		[LC_OTHER] = LS_COMMENT, [LC_LETTER] = LS_COMMENT, [LC_DIGIT] = LS_COMMENT, 
+		[LC_SPACE] = LS_COMMENT, [LC_COLON] = LS_COMMENT, [LC_EQUAL] = LS_COMMENT, 
+		[LC_LESS] = LS_COMMENT, [LC_GREATER] = LS_COMMENT, [LC_SLASH] = LS_COMMENT, 
+		[LC_STAR] = LS_COMMENT_STAR, [LC_PUNCT] = LS_COMMENT
+	},
+	[LS_COMMENT_STAR] = {
+		[LC_OTHER] = LS_COMMENT, [LC_LETTER] = LS_COMMENT, [LC_DIGIT] = LS_COMMENT, 
+		[LC_SPACE] = LS_COMMENT, [LC_COLON] = LS_COMMENT, [LC_EQUAL] = LS_COMMENT, 
+		[LC_LESS] = LS_COMMENT, [LC_GREATER] = LS_COMMENT, [LC_SLASH] = LS_COMMENT_END, 
+		[LC_STAR] = LS_COMMENT_STAR, [LC_PUNCT] = LS_COMMENT
+	}
+};
+
+// token produced when the dfa stops in each state, 0 if the state doesn't accept
+const unsigned char lexer_accept[LS_STATE_COUNT] = {
+	[LS_IDENTIFIER] = identifier, [LS_NUMBER] = number, 
+	[LS_ASSIGN] = assignment_symbol, [LS_LESS] = less_than, 
+	[LS_LESS_EQUAL] = less_than_or_equal_to, [LS_NOT_EQUAL] = not_equal_to, 
+	[LS_GREATER] = greater_than, [LS_GREATER_EQUAL] = greater_than_or_equal_to, 
+	[LS_SLASH] = division
+};
+
+// perfect hash over the keyword set: (first + 10 * second + 13 * length) % 18
+typedef struct keyword_entry {
+	char *name;
+	token_type type;
+} keyword_entry;
+
+const keyword_entry keyword_table[18] = {
+	[0] = {"while", keyword_while}, [1] = {"procedure", keyword_procedure}, 
+	[2] = {"then", keyword_then}, [3] = {"begin", keyword_begin}, 
+	[5] = {"call", keyword_call}, [6] = {"read", keyword_read}, 
+	[9] = {"else", keyword_else}, [10] = {"write", keyword_write}, 
+	[11] = {"var", keyword_var}, [12] = {"do", keyword_do}, 
+	[14] = {"const", keyword_const}, [15] = {"def", keyword_def}, 
+	[16] = {"end", keyword_end}, [17] = {"if", keyword_if}
+};
+
+// how each token is written, for printing source back from the lexemes
+const char *const token_spelling[] = {
+	[identifier] = "identifier", [number] = "number", [keyword_const] = "const", 
+	[keyword_var] = "var", [keyword_procedure] = "procedure", [keyword_call] = "call", 
+	[keyword_begin] = "begin", [keyword_end] = "end", [keyword_if] = "if", 
+	[keyword_then] = "then", [keyword_else] = "else", [keyword_while] = "while", 
+	[keyword_do] = "do", [keyword_read] = "read", [keyword_write] = "write", 
+	[keyword_def] = "def", [period] = ".", [assignment_symbol] = ":=", [minus] = "-", 
+	[semicolon] = ";", [left_curly_brace] = "{", [right_curly_brace] = "}", 
+	[equal_to] = "=", [not_equal_to] = "<>", [less_than] = "<", 
+	[less_than_or_equal_to] = "<=", [greater_than] = ">", 
+	[greater_than_or_equal_to] = ">=", [plus] = "+", [times] = "*", 
+	[division] = "/", [left_parenthesis] = "(", [right_parenthesis] = ")"
+};
+
+// statements longer than this many tokens are cut short when printed
+#define SOURCE_TEXT_TOKENS 8
 
 // given functions
 void emit(int op, int l, int m);
+void emit_variable_access(int op, int symbol_index);
+void emit_call(int symbol_index);
 void add_symbol(int kind, char name[], int value, int level, int address);
 void mark();
 int multiple_declaration_check(char name[]);
 int find_symbol(char name[], int kind);
 
+// intermediate representation
+void ir_begin_procedure(int symbol_index, int source);
+int ir_new_block();
+void ir_add_node(int op, int l, int m, int symbol);
+int ir_label();
+void ir_copy_nodes(int first, int end);
+int ir_jump(int op, int list);
+void ir_patch_jumps(int list, int target);
+int emit_branch(int relation, int list);
+void ir_finish_procedure(ir_procedure *procedure);
+void ir_finish_program();
+void lower_finished_procedures(int finished);
+bool calls_resolved(ir_procedure *procedure);
+void lower_procedure(ir_procedure *procedure);
+void lower_node(ir_procedure *procedure, ir_node *node);
+void emit_instruction(int op, int l, int m, int source);
+
+// expression trees
+int expression_leaf(int op, int m, int symbol);
+int expression_operation(int operation, int left, int right);
+int add_expression_node(int op, int m, int left, int right);
+bool fold_operation(int operation, int a, int b, int *result);
+bool constant_node(int node, int value);
+void emit_expression(int node);
+
+// source map
+int add_source(int procedure_index, bool block);
+void build_source_map();
+void print_source_text(FILE *ofp, int source);
+
+// token storage
+void add_token(int type, uint32_t payload);
+void add_number_token(int value);
+void flush_token_sink();
+void receive_tokens(int index);
+uint32_t hash_identifier(char name[]);
+uint32_t intern_identifier(char name[]);
+intern_level *intern_level_at(_Atomic(intern_level *) *link, uint32_t slot_count);
+uint32_t store_identifier(char name[]);
+uint32_t pool_number(int value);
+token_type token_type_at(int index);
+char *token_name(int index);
+int token_number(int index);
+
+// lexeme validation, VALIDATE_LANES lexemes at a time as one 64 bit lane 
+// each, type in the low byte and payload in the high half
+#define VALIDATE_LANES 8
+
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define VALIDATE_VECTORS 1
+typedef uint64_t lexeme_vector __attribute__((vector_size(VALIDATE_LANES * sizeof(uint64_t))));
+#endif
+
+bool valid_lexeme(const lexeme *entry, uint32_t identifier_limit);
+bool structural_token(int type);
+void note_structure(lexeme_summary *summary, int index, int type, int **open, int *open_count, 
+	int *open_capacity, int *procedure_capacity, int *pending);
+
+// lexer
+int read_token_text(const char *text, int length);
+bool read_token_int(const char **text, const char *end, int *value);
+int lex_source(const char *source, int length);
+token_type keyword_lookup(const char *word, int length);
+
+// diagnostics
+void parser_error(int error_code, int case_code);
+void lexer_error(int error_code);
+void add_diagnostic(diagnostic_kind kind, int error_code, int case_code);
+const char *lexer_error_message(int error_code);
+const char *parser_error_message(int error_code, int case_code);
+void print_diagnostics(FILE *ofp);
+
+// pipeline queues
+bool stage_queue_init(stage_queue *queue, uint32_t capacity, size_t element_size);
+void stage_queue_destroy(stage_queue *queue);
+void stage_queue_send(stage_queue *queue, const void *elements, int count);
+int stage_queue_receive(stage_queue *queue, void *elements, int limit);
+void stage_queue_close(stage_queue *queue);
+void stage_wait(int *spins);
+
+// arena
+void reserve_trace_buffer();
+void trace_begin(const char *name, int symbol_index, int block_level);
+void trace_end(const char *name);
+void record_trace_event(char phase, const char *name, int symbol_index, int block_level);
+long long trace_clock();
+
+void *arena_allocate(arena *pool, size_t size);
+void *compile_allocate(size_t size);
+void out_of_memory();
+void fill_out_of_memory_result(compile_result *result);
+void *arena_resize(arena *pool, void *allocation, size_t old_size, size_t new_size);
+void arena_reset(arena *pool);
+void arena_release(arena *pool);
+void *grow_array(void *array, int *capacity, int minimum, size_t element_size);
+
+// compiler state
+void reset_parser_state();
+void forget_compiler_storage();
+void fill_compile_result(compile_result *result);
+void reserve_tokens(int count);
+
+// cli
+int read_stdin(void *context);
+void write_stdout(void *context, int value);
+
+// -batch, a record is one line of input and its output goes on one line
+#define BATCH_RECORDS 4096
+
+typedef struct batch_record {
+	char *line;
+	char *cursor;
+	char *output;
+	size_t output_length;
+	size_t output_capacity;
+} batch_record;
+
+int read_record(void *context);
+void write_record(void *context, int value);
+void run_batch(FILE *ifp, FILE *ofp);
+
+char *read_file(const char *name, long *length);
+bool link_files(char **names, int count);
+void save_trace(const char *name);
+
+// -pipeline, the lexer and the listing's formatting run on threads of their 
+// own while this one parses
+typedef struct pipeline {
+	const char *input;
+	long length;
+	bool source_input;
+	int lexer_error_code;
+	stage_queue lexemes;
+	stage_queue code;
+	FILE *listing;
+	char *listing_text;
+	size_t listing_length;
+} pipeline;
+
+void compile_pipelined(const char *input, long length, bool source_input, FILE *ofp);
+void *lexer_stage(void *argument);
+void *writer_stage(void *argument);
+
+// server mode
+bool read_fully(int fd, char *buffer, size_t length);
+bool write_fully(int fd, const char *buffer, size_t length);
+int serve_requests(int in_fd, int out_fd);
+int serve_socket(char *path);
+
+// binary output
+void print_allocation_stats(FILE *ofp);
+
+// -profile, how many of the hottest procedures, statements and instructions 
+// the report lists
+#define PROFILE_ENTRIES 10
+
+void print_profile(FILE *ofp, const long *executed);
+int hottest_entry(const long *totals, bool *listed, int count);
+void write_code_image(FILE *ofp);
+void write_name(FILE *ofp, const char *name);
+void write_int32(FILE *ofp, int value);
+
+// code analysis
+int find_procedures(procedure_range *ranges);
+void find_procedure_parents(procedure_range *ranges, int count, int *parents);
+int enclosing_procedure(int symbol_index);
+int procedure_block_level(int symbol_index);
+bool *find_jump_targets();
+void remove_instructions(bool *removed);
+
+// optimization passes
+void optimize_program();
+bool inline_calls();
+void eliminate_dead_procedures();
+void shrink_frames();
+void convert_tail_calls();
+bool merge_procedures();
+uint32_t procedure_body_hash(procedure_range *range);
+bool same_procedure_body(procedure_range *a, procedure_range *b);
+int body_operand(procedure_range *range, int index);
+void select_superinstructions();
+void fuse_compare_branches();
+
+// stack analysis
+void compute_stack_depths();
+int code_stack_depth(int *peak_at);
+int trace_stack_depths(const instruction *code, int code_length, int *peak_at, int *depth, int *worklist, 
+	bool *queued);
+
+// separate compilation
+int declare_external(char name[]);
+int relocation_kind_at(int index, int block_level, int *external);
+
+// c backend
+void print_c_code(FILE *ofp);
+void print_c_procedure_name(FILE *ofp, int symbol_index);
+
+// the C operator for each relation from EQL to GEQ, a CJP branches when it's false
+const char *const c_relations[] = {"==", "!=", "<", "<=", ">", ">="};
+
 // given print functions
-void print_parser_error(int error_code, int case_code);
-void print_assembly_code();
-void print_symbol_table();
+void print_assembly_code(FILE *ofp);
+void print_instruction(FILE *ofp, int line, const instruction *ir);
+void print_symbol_table(FILE *ofp);
 
 // MY CODE CALLS
 void program();
@@ -74,196 +568,1365 @@ void constants();
 void variables(int numVars);
 void procedures();
 void statement();
-void factor();
+void parse_statement();
+int condition();
+int negate_relation(int relation);
+void expression();
+int parse_expression();
+int term();
+int factor();
+
+#ifndef PARSER_LIBRARY
+bool show_allocation_stats = false;
+
+// cli io for running programs: RED reads an integer from stdin, WRT prints one
+int read_stdin(void *context)
+{
+	int value = 0;
+	(void) context;
+	if (scanf("%d", &value) != 1)
+		value = 0;
+	return value;
+}
+
+void write_stdout(void *context, int value)
+{
+	(void) context;
+	printf("%d\n", value);
+}
+
+// RED takes the next integer on the record's line, 0 once it runs out
+int read_record(void *context)
+{
+	batch_record *record = context;
+	char *end;
+	long value = strtol(record->cursor, &end, 10);
+
+	if (end == record->cursor)
+		return 0;
+	record->cursor = end;
+	return (int) value;
+}
+
+void write_record(void *context, int value)
+{
+	batch_record *record = context;
+	char *output;
+
+	if (record->output_length + 16 > record->output_capacity)
+	{
+		record->output_capacity = record->output_capacity * 2 + 64;
+		output = realloc(record->output, record->output_capacity);
+		if (output == NULL)
+			return;
+		record->output = output;
+	}
+	record->output_length += sprintf(record->output + record->output_length, 
+		record->output_length > 0 ? " %d" : "%d", value);
+}
+
+// runs the compiled program once per line of ifp, BATCH_RECORDS lines at a 
+// 		time through run_program_batch(), and prints each record's output 
+// 		on a line of its own followed by the error if it didn't halt
+void run_batch(FILE *ifp, FILE *ofp)
+{
+	batch_record *records = calloc(BATCH_RECORDS, sizeof(batch_record));
+	vm_io *io = malloc(BATCH_RECORDS * sizeof(vm_io));
+	vm_status *status = malloc(BATCH_RECORDS * sizeof(vm_status));
+	size_t capacity;
+	int count;
+	int i;
+
+	if (records == NULL || io == NULL || status == NULL)
+	{
+		free(records);
+		free(io);
+		free(status);
+		return;
+	}
+	do
+	{
+		for (count = 0; count < BATCH_RECORDS; count++)
+		{
+			capacity = 0;
+			records[count].line = NULL;
+			if (getline(&records[count].line, &capacity, ifp) < 0)
+			{
+				free(records[count].line);
+				break;
+			}
+			records[count].cursor = records[count].line;
+			records[count].output_length = 0;
+			io[count].read = read_record;
+			io[count].write = write_record;
+			io[count].context = &records[count];
+		}
+
+		run_program_batch(code, code_index, max_stack_depth, count, io, status);
+
+		for (i = 0; i < count; i++)
+		{
+			if (records[i].output_length > 0)
+				fwrite(records[i].output, 1, records[i].output_length, ofp);
+			if (status[i] != vm_halted)
+				fprintf(ofp, records[i].output_length > 0 ? " %s" : "%s", vm_status_message(status[i]));
+			fputc('\n', ofp);
+			free(records[i].line);
+		}
+	} while (count == BATCH_RECORDS);
+
+	for (i = 0; i < BATCH_RECORDS; i++)
+		free(records[i].output);
+	free(records);
+	free(io);
+	free(status);
+}
 
 int main(int argc, char *argv[])
 {
 	// variable setup
+	compile_result result;
+	char *file_name = NULL;
+	char *socket_path = NULL;
+	char *trace_path = NULL;
+	char *input;
+	long length;
+	bool source_input = false;
+	bool serve_stdin = false;
+	bool run = false;
+	bool jit = false;
+	bool batch = false;
+	bool emit_c = false;
+	bool module = false;
+	bool link = false;
+	bool pipelined = false;
+	bool profile = false;
+	char **object_names = malloc(argc * sizeof(char *));
+	int object_count = 0;
 	int i;
-	tokens = calloc(ARRAY_SIZE, sizeof(lexeme));
-	table = calloc(ARRAY_SIZE, sizeof(symbol));
-	code = calloc(ARRAY_SIZE, sizeof(instruction));
-	FILE *ifp;
-	int buffer;
 	
-	// read in input
-	if (argc < 2)
+	// read in input, -s means the file is PL/0 source rather than lexer output
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-s") == 0)
+			source_input = true;
+		else if (strcmp(argv[i], "-run") == 0)
+			run = true;
+		else if (strcmp(argv[i], "-profile") == 0)
+			run = profile = true;
+		else if (strcmp(argv[i], "-jit") == 0)
+			jit = true;
+		else if (strcmp(argv[i], "-batch") == 0)
+			batch = true;
+		else if (strcmp(argv[i], "-emit-c") == 0)
+			emit_c = true;
+		else if (strcmp(argv[i], "-c") == 0)
+			module = true;
+		else if (strcmp(argv[i], "-link") == 0)
+			link = true;
+		else if (strcmp(argv[i], "-pipeline") == 0)
+			pipelined = true;
+		else if (strcmp(argv[i], "-O") == 0)
+			set_optimizations(optimize_all);
+		else if (strcmp(argv[i], "-fdead-procedures") == 0)
+			set_optimizations(optimizations | optimize_dead_procedures);
+		else if (strcmp(argv[i], "-fshrink-frames") == 0)
+			set_optimizations(optimizations | optimize_frames);
+		else if (strcmp(argv[i], "-fglobal-addressing") == 0)
+			set_optimizations(optimizations | optimize_global_addressing);
+		else if (strcmp(argv[i], "-fmerge-procedures") == 0)
+			set_optimizations(optimizations | optimize_merge_procedures);
+		else if (strcmp(argv[i], "-fexpressions") == 0)
+			set_optimizations(optimizations | optimize_expressions);
+		else if (strcmp(argv[i], "-fbranches") == 0)
+			set_optimizations(optimizations | optimize_branches);
+		else if (strcmp(argv[i], "-fsuperinstructions") == 0)
+			set_optimizations(optimizations | optimize_superinstructions);
+		else if (strcmp(argv[i], "-ftail-calls") == 0)
+			set_optimizations(optimizations | optimize_tail_calls);
+		else if (strcmp(argv[i], "-finline") == 0)
+			set_optimizations(optimizations | optimize_inline);
+		else if (strcmp(argv[i], "-finline-limit") == 0 && i + 1 < argc)
+			set_inline_limit(atoi(argv[++i]));
+		else if (strcmp(argv[i], "-stats") == 0)
+			show_allocation_stats = true;
+		else if (strcmp(argv[i], "-serve") == 0)
+			serve_stdin = true;
+		else if (strcmp(argv[i], "-socket") == 0 && i + 1 < argc)
+			socket_path = argv[++i];
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+			trace_path = argv[++i];
+		else
+		{
+			file_name = argv[i];
+			object_names[object_count++] = argv[i];
+		}
+	}
+	set_module_mode(module);
+	if (trace_path != NULL)
+		start_tracing();
+
+	// server modes keep compiling requests until their input closes
+	if (serve_stdin)
+		return serve_requests(STDIN_FILENO, STDOUT_FILENO);
+	if (socket_path != NULL)
+		return serve_socket(socket_path);
+
+	if (file_name == NULL)
 	{
 		printf("Error : please include the file name\n");
 		return 0;
 	}
-	
-	ifp = fopen(argv[1], "r");
-	while(fscanf(ifp, "%d", &buffer) != EOF)
+
+	// -link puts objects together instead of compiling, the linked program 
+	// goes through the same output options as a compiled one
+	if (link)
 	{
-		tokens[token_index].type = buffer;
-		if (buffer == identifier)
-			fscanf(ifp, "%s", tokens[token_index].identifier_name);
-		else if (buffer == number)
-			fscanf(ifp, "%d", &(tokens[token_index].number_value));
-		token_index++;
+		input = NULL;
+		error = link_files(object_names, object_count) ? 0 : -1;
 	}
-	fclose(ifp);
-	token_index = 0;
-	
-	/* print out tokens to visualize initial input
-	for(int k = 0; k < ARRAY_SIZE; k++) {
-		if(tokens[k].type != 0) {
-			printf("%d %s %d %d\n", tokens[k].type, tokens[k].identifier_name, 
-			tokens[k].number_value, tokens[k].error_type);
+	else
+	{
+		// slurp the whole file so either front end can run over one buffer
+		input = read_file(file_name, &length);
+		if (input == NULL)
+		{
+			printf("Error : could not open %s\n", file_name);
+			free(object_names);
+			return 0;
 		}
-	} */
 
-	// call program
-	program();
+		/* print out tokens to visualize initial input
+		for(int k = 0; k < token_count; k++) {
+			printf("%d %s %d\n", token_type_at(k), 
+			token_type_at(k) == identifier ? token_name(k) : "", 
+			token_type_at(k) == number ? token_number(k) : 0);
+		} */
+
+		// -pipeline only applies to the plain listing, which it prints itself
+		if (pipelined && optimizations == 0 && !module && !emit_c && !run && !jit && !batch)
+		{
+			compile_pipelined(input, length, source_input, stdout);
+			if (show_allocation_stats)
+				print_allocation_stats(stderr);
+			if (trace_path != NULL)
+				save_trace(trace_path);
+			free(input);
+			free(object_names);
+			release_compiler_state();
+			return 0;
+		}
+
+		// call program
+		if (source_input)
+			compile_source(input, length, &result);
+		else
+			compile_token_text(input, length, &result);
+	}
+	free(object_names);
+
+	// print errors, or the assembly code and table if there weren't any, 
+	// -run and -jit execute the program instead, -batch once per input line 
+	// and -c writes the module's object
+	print_diagnostics(stdout);
+	if (error != -1 && batch)
+		run_batch(stdin, stdout);
+	else if (error != -1 && (run || jit))
+	{
+		vm_io io = { read_stdin, write_stdout, NULL };
+		vm_status status = vm_unsupported;
+		vm_stats stats = { 0 };
+		if (profile)
+			stats.executed = malloc((code_index + 1) * sizeof(long));
+		if (jit && !profile)
+			status = jit_run_program(code, code_index, max_stack_depth, &io);
+		if (status == vm_unsupported)
+			status = run_program(code, code_index, max_stack_depth, &io, &stats);
+		if (status != vm_halted)
+			printf("%s\n", vm_status_message(status));
+		if (show_allocation_stats && !jit)
+			fprintf(stderr, "VM: %ld instructions, %ld calls\n", stats.instructions, stats.calls);
+		if (profile && stats.executed != NULL)
+			print_profile(stderr, stats.executed);
+		free(stats.executed);
+	}
+	else if (error != -1 && emit_c && !link)
+		print_c_code(stdout);
+	else if (error != -1 && module)
+		write_object(stdout);
+	else if (error != -1)
+	{
+		// a linked program has no symbol table
+		print_assembly_code(stdout);
+		if (!link)
+			print_symbol_table(stdout);
+	}
+	if (show_allocation_stats)
+		print_allocation_stats(stderr);
+	if (trace_path != NULL)
+		save_trace(trace_path);
 	
-	free(tokens);
-	free(table);
-	free(code);
+	free(input);
+	release_compiler_state();
 	return 0;
 }
 
-// program function
-void program() {
-
-	//printf("start program\n");
+// compiles with the lexer, the parser and the listing's formatting each on 
+// 		their own thread, printing the same thing as the sequential path. the 
+// 		writer formats every procedure as soon as it is lowered, only the JMP 
+// 		to main has to wait for main and goes in front at the end
+void compile_pipelined(const char *input, long length, bool source_input, FILE *ofp)
+{
+	pipeline stages;
+	compile_result result;
+	pthread_t lexer;
+	pthread_t writer;
+
+	memset(&stages, 0, sizeof(stages));
+	stages.input = input;
+	stages.length = length;
+	stages.source_input = source_input;
+	stages.listing = open_memstream(&stages.listing_text, &stages.listing_length);
+	if (stages.listing == NULL || !stage_queue_init(&stages.lexemes, STAGE_QUEUE_CAPACITY, sizeof(lexeme)) || 
+		!stage_queue_init(&stages.code, STAGE_QUEUE_CAPACITY, sizeof(instruction)))
+	{
+		// stages starts zeroed, so whatever wasn't set up is NULL here
+		printf("Error : could not start the pipeline\n");
+		if (stages.listing != NULL)
+			fclose(stages.listing);
+		free(stages.listing_text);
+		stage_queue_destroy(&stages.lexemes);
+		stage_queue_destroy(&stages.code);
+		return;
+	}
 
-	// add symbol to end of table
-	add_symbol(3, "main", 0, 0, 0);
+	begin_compilation();
+	token_source = &stages.lexemes;
+	code_sink = &stages.code;
+	pthread_create(&lexer, NULL, lexer_stage, &stages);
+	pthread_create(&writer, NULL, writer_stage, &stages);
+	compile_lexemes(tokens, token_count, &result);
+
+	// the parser can stop early on an error, the lexer still has to finish. 
+	// its lexemes are kept so the summary can cover all of them
+	receive_tokens(INT_MAX);
+	stage_queue_close(&stages.code);
+	pthread_join(lexer, NULL);
+	pthread_join(writer, NULL);
+	token_source = NULL;
+	code_sink = NULL;
+	fclose(stages.listing);
+
+	// compile_lexemes() validated nothing, the lexemes were still streaming in
+	validate_lexemes(tokens, token_count, &lexeme_info);
+	result.lexemes = lexeme_info;
+
+	// a lexical error wins over whatever the parser made of the tokens 
+	// before it, as if lexing had finished first
+	if (stages.lexer_error_code != 0)
+	{
+		diagnostic_count = 0;
+		lexer_error(stages.lexer_error_code);
+		error = -1;
+	}
+	print_diagnostics(ofp);
+	if (error != -1)
+	{
+		fprintf(ofp, "Assembly Code:\n");
+		fprintf(ofp, "Line\tOP Code\tOP Name\tL\tM\n");
+		print_instruction(ofp, 0, &code[0]);
+		fwrite(stages.listing_text, 1, stages.listing_length, ofp);
+		fprintf(ofp, "\n");
+		print_symbol_table(ofp);
+	}
 
-	// set level to -1
-	level = -1;
+	free(stages.listing_text);
+	stage_queue_destroy(&stages.lexemes);
+	stage_queue_destroy(&stages.code);
+}
 
-	// emit jmp, M = 0, L = 0
-	emit(JMP, 0, 0);
+// turns the input into lexemes for the parser thread
+void *lexer_stage(void *argument)
+{
+	pipeline *stages = argument;
+	int result;
+
+	begin_compilation();
+	token_sink = &stages->lexemes;
+	trace_begin("lex", -1, 0);
+	if (stages->source_input)
+		result = lex_source(stages->input, stages->length);
+	else
+		result = read_token_text(stages->input, stages->length);
+	flush_token_sink();
+	trace_end("lex");
+	if (result == -1 && diagnostic_count > 0)
+		stages->lexer_error_code = diagnostics[0].error_code;
+	stage_queue_close(&stages->lexemes);
+	token_sink = NULL;
+	release_compiler_state();
+	return NULL;
+}
 
-	//printf("program before block\n");
+// formats lowered code into the listing as it arrives, it starts at line 1
+void *writer_stage(void *argument)
+{
+	pipeline *stages = argument;
+	instruction batch[STAGE_BATCH];
+	int line = 1;
+	int count;
+	int i;
 
-	// call block()
-	block();
+	trace_begin("print assembly code", -1, 0);
+	while ((count = stage_queue_receive(&stages->code, batch, STAGE_BATCH)) > 0)
+		for (i = 0; i < count; i++)
+			print_instruction(stages->listing, line++, &batch[i]);
+	trace_end("print assembly code");
+	return NULL;
+}
 
-	//printf("program after block\n");
+// writes the -trace file, load it in Perfetto or chrome://tracing
+void save_trace(const char *name)
+{
+	FILE *ofp = fopen(name, "w");
 
-	// if error, stop execution
-	if(error == -1) {
+	if (ofp == NULL)
+	{
+		printf("Error : could not open %s\n", name);
 		return;
 	}
+	write_trace(ofp);
+	fclose(ofp);
+}
 
-	//printf("%d\n", token_index);
+// reads a whole file into a null terminated buffer, NULL if it can't be opened
+char *read_file(const char *name, long *length)
+{
+	FILE *ifp = fopen(name, "rb");
+	char *buffer;
+
+	if (ifp == NULL)
+		return NULL;
+	fseek(ifp, 0, SEEK_END);
+	*length = ftell(ifp);
+	fseek(ifp, 0, SEEK_SET);
+	buffer = malloc(*length + 1);
+	if (buffer != NULL)
+	{
+		*length = fread(buffer, 1, *length, ifp);
+		buffer[*length] = '\0';
+	}
+	fclose(ifp);
+	return buffer;
+}
 
-	// if current token != period
-	if(tokens[token_index].type != period) {
+// links the named objects and loads the result into this thread's code as 
+// 		if it had just been compiled, prints why and returns false if it 
+// 		couldn't
+bool link_files(char **names, int count)
+{
+	unsigned char **objects = calloc(count, sizeof(unsigned char *));
+	long *lengths = calloc(count, sizeof(long));
+	link_result linked;
+	link_status status = link_ok;
+	bool opened = true;
+	int i;
 
-		// error 1, return
-		print_parser_error(1, 0);
+	for (i = 0; i < count && opened; i++)
+	{
+		objects[i] = (unsigned char *) read_file(names[i], &lengths[i]);
+		if (objects[i] == NULL)
+		{
+			printf("Error : could not open %s\n", names[i]);
+			opened = false;
+		}
+	}
+	if (opened)
+	{
+		status = link_objects((const unsigned char *const *) objects, lengths, count, &linked);
+		if (status == link_ok)
+		{
+			begin_compilation();
+			for (i = 0; i < linked.code_length; i++)
+				emit_instruction(linked.code[i].op, linked.code[i].l, linked.code[i].m, -1);
+			max_stack_depth = code_stack_depth(NULL);
+			free(linked.code);
+		}
+		else if (linked.symbol[0] != '\0')
+			printf("%s: %s\n", link_status_message(status), linked.symbol);
+		else
+			printf("%s\n", link_status_message(status));
+	}
 
-		// error = -1;
-		error = -1;
+	for (i = 0; i < count; i++)
+		free(objects[i]);
+	free(objects);
+	free(lengths);
+	return opened && status == link_ok;
+}
 
-		// stop execution
-		return;
+// reads exactly length bytes, returns false on end of input or an error
+bool read_fully(int fd, char *buffer, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t got = read(fd, buffer, length);
+		if (got <= 0)
+			return false;
+		buffer += got;
+		length -= got;
 	}
-	
-	// for each CAL instruction in code
-	for(int j = 0; j < code_index; j++) {
+	return true;
+}
 
-		// if is cal
-		if(code[j].op == CAL) {
+bool write_fully(int fd, const char *buffer, size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t put = write(fd, buffer, length);
+		if (put <= 0)
+			return false;
+		buffer += put;
+		length -= put;
+	}
+	return true;
+}
 
-			// set M val of the instruction to the address of the procedure
-			code[j].m = table[code[j].m].address;
+// answers length-prefixed compile requests until in_fd closes, see parser.h 
+// 		for the framing. the request buffer, response stream and compiler 
+// 		state all stay warm from one request to the next
+int serve_requests(int in_fd, int out_fd)
+{
+	compile_result result;
+	unsigned char header[4];
+	char *request = NULL;
+	size_t request_capacity = 0;
+	char *response = NULL;
+	size_t response_size = 0;
+	FILE *response_stream = open_memstream(&response, &response_size);
+	uint32_t length;
+	long response_length;
+	int flags;
+	long requests = 0;
+	allocation_stats warm = { 0 };
+
+	while (read_fully(in_fd, (char *) header, 4))
+	{
+		length = (uint32_t) header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+		if (length > request_capacity)
+		{
+			request_capacity = length;
+			request = realloc(request, request_capacity);
+		}
+		if (!read_fully(in_fd, request, length))
+			break;
 
+		// compile
+		flags = length > 0 ? (unsigned char) request[0] : 0;
+		if (flags & REQUEST_SOURCE)
+			compile_source(request + 1, length > 0 ? length - 1 : 0, &result);
+		else
+			compile_token_text(request + 1, length > 0 ? length - 1 : 0, &result);
+
+		// status byte, then errors, a code image or the listing
+		fseek(response_stream, 0, SEEK_SET);
+		fputc(error == -1 ? 1 : 0, response_stream);
+		if (error == -1)
+			print_diagnostics(response_stream);
+		else if (flags & REQUEST_BINARY)
+			write_code_image(response_stream);
+		else
+		{
+			print_assembly_code(response_stream);
+			print_symbol_table(response_stream);
 		}
+		fflush(response_stream);
+		response_length = ftell(response_stream);
+
+		header[0] = response_length >> 24;
+		header[1] = response_length >> 16;
+		header[2] = response_length >> 8;
+		header[3] = response_length;
+		if (!write_fully(out_fd, (char *) header, 4) || !write_fully(out_fd, response, response_length))
+			break;
 
+		// after the first request the arena should be big enough for the rest
+		if (++requests == 1)
+			get_allocation_stats(&warm);
 	}
 
-	// since we know main's address, fix initial jump
-	// main is first entry in symbol table
-	// edit code array at index 0
-	code[0].m = table[0].address;
+	if (show_allocation_stats && requests > 0)
+	{
+		allocation_stats now;
+		get_allocation_stats(&now);
+		print_allocation_stats(stderr);
+		fprintf(stderr, "%ld requests, %ld mallocs after the first\n", 
+			requests, now.malloc_calls - warm.malloc_calls);
+	}
 
-	// emit HLT, L = 0
-	emit(SYS, 0, HLT);
+	fclose(response_stream);
+	free(response);
+	free(request);
+	release_compiler_state();
+	return 0;
+}
 
-	//printf("print point\n");
+// listens on a unix domain socket and serves one connection at a time
+int serve_socket(char *path)
+{
+	struct sockaddr_un address;
+	int listener;
+	int connection;
+
+	// a client hanging up early shouldn't take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	unlink(path);
+	if (listener == -1 || bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1 || 
+		listen(listener, 16) == -1)
+	{
+		printf("Error : could not listen on %s\n", path);
+		return 1;
+	}
 
-	// print assembly code and table
-	print_assembly_code();
-	print_symbol_table();
+	while ((connection = accept(listener, NULL, NULL)) != -1)
+	{
+		serve_requests(connection, connection);
+		close(connection);
+	}
 
-	// END OF PROGRAM()
+	close(listener);
+	return 0;
 }
+#endif
 
-// block function
-void block() {
-	// the very last symbol added to the symbol table was the current procedure, 
-	// whether this was main or a subprocedure, we need to save where the procedure
-	//  is in the symbol table before we add more symbols, so we can use it to set 
-	// the address before we emit code in statement
-
-	//printf("block before declarations\n");
-
-	// increment level
-	level++;
+// one line summary of this thread's compiler arena
+void print_allocation_stats(FILE *ofp)
+{
+	allocation_stats stats;
+	get_allocation_stats(&stats);
+	fprintf(ofp, "Arena: %ld allocations, %ld mallocs, %ld resets, %ld bytes reserved, %ld bytes high water\n", 
+		stats.allocations, stats.malloc_calls, stats.resets, stats.bytes_reserved, stats.high_water);
+}
 
-	// inc_m_value to declarations call
-	int inc_m_value = declarations();
+// the execution counts of a -profile run, charged to procedures and to 
+// 		statements through the source map. a procedure's calls are how 
+// 		often its INC ran, its instructions include whatever was inlined 
+// 		from it into other procedures
+void print_profile(FILE *ofp, const long *executed)
+{
+	long *procedure_totals = compile_allocate((table_index + 1) * sizeof(long));
+	long *source_totals = compile_allocate((source_count + 1) * sizeof(long));
+	bool *listed = compile_allocate((code_index + table_index + source_count + 1) * sizeof(bool));
+	long total = 0;
+	int span;
+	int entry;
+	int i;
 
-	// if error, return
-	if(inc_m_value == -1) {
-		error = -1;
-		return;
+	memset(procedure_totals, 0, (table_index + 1) * sizeof(long));
+	memset(source_totals, 0, (source_count + 1) * sizeof(long));
+	for (i = 0; i < code_index; i++)
+	{
+		total += executed[i];
+		span = find_source_span(source_map, source_map_length, i);
+		if (span != -1 && code_sources[i] != -1)
+		{
+			procedure_totals[source_map[span].procedure] += executed[i];
+			source_totals[code_sources[i]] += executed[i];
+		}
+	}
+	if (total == 0)
+		total = 1;
+
+	fprintf(ofp, "Hot Procedures:\n");
+	fprintf(ofp, "Instructions | %%     | Calls      | Procedure\n");
+	memset(listed, 0, table_index * sizeof(bool));
+	for (i = 0; i < PROFILE_ENTRIES && (entry = hottest_entry(procedure_totals, listed, table_index)) != -1; i++)
+		fprintf(ofp, "%12ld | %5.1f | %10ld | %s\n", procedure_totals[entry], 100.0 * procedure_totals[entry] / total, 
+			table[entry].address >= 0 && table[entry].address / 3 < code_index ? executed[table[entry].address / 3] : 0, 
+			table[entry].name);
+
+	fprintf(ofp, "\nHot Statements:\n");
+	fprintf(ofp, "Instructions | %%     | Procedure   | Statement\n");
+	memset(listed, 0, source_count * sizeof(bool));
+	for (i = 0; i < PROFILE_ENTRIES && (entry = hottest_entry(source_totals, listed, source_count)) != -1; i++)
+	{
+		fprintf(ofp, "%12ld | %5.1f | %-11s | ", source_totals[entry], 100.0 * source_totals[entry] / total, 
+			table[sources[entry].procedure].name);
+		print_source_text(ofp, entry);
+		fprintf(ofp, "\n");
 	}
 
-	//printf("block before procedures\n");
-
-	procedures();
-
-	// once we emit INC, we'll be emitting code so this is where the procedure starts, 
-	// multiply by 3 bc PAS format
-	table[table_index].address = code_index * 3;
+	fprintf(ofp, "\nHot Instructions:\n");
+	fprintf(ofp, "Count\tLine\tOP Code\tOP Name\tL\tM\n");
+	memset(listed, 0, code_index * sizeof(bool));
+	for (i = 0; i < PROFILE_ENTRIES && (entry = hottest_entry(executed, listed, code_index)) != -1; i++)
+	{
+		fprintf(ofp, "%ld\t", executed[entry]);
+		print_instruction(ofp, entry, &code[entry]);
+		fprintf(ofp, "\t\t");
+		print_source_text(ofp, code_sources[entry]);
+		fprintf(ofp, "\n");
+	}
+	fprintf(ofp, "\n");
+}
 
-	// emit() INC (m = inc_m_value)
-	emit(INC, 0, inc_m_value);
+// the largest total not listed yet, which it marks as listed, or -1 once 
+// 		only zeros are left
+int hottest_entry(const long *totals, bool *listed, int count)
+{
+	int best = -1;
+	int i;
 
-	//printf("block before state\n");
+	for (i = 0; i < count; i++)
+		if (!listed[i] && totals[i] > 0 && (best == -1 || totals[i] > totals[best]))
+			best = i;
+	if (best != -1)
+		listed[best] = true;
+	return best;
+}
 
-	// call statement
-	statement();
+// writes the compiled code as a binary image, see parser.h for the layout
+void write_code_image(FILE *ofp)
+{
+	int i;
+	int procedure_count = 0;
 
-	//printf("block after state\n");
+	trace_begin("write code image", -1, 0);
 
-	// if error, return
-	if(error == -1) {
-		return;
+	fwrite(CODE_IMAGE_MAGIC, 1, 4, ofp);
+	write_int32(ofp, CODE_IMAGE_VERSION);
+	write_int32(ofp, max_stack_depth);
+	for (i = 0; i < table_index; i++)
+		if (table[i].kind == 3 && table[i].address >= 0)
+			procedure_count++;
+	write_int32(ofp, procedure_count);
+	for (i = 0; i < table_index; i++)
+		if (table[i].kind == 3 && table[i].address >= 0)
+		{
+			write_int32(ofp, table[i].address);
+			write_int32(ofp, table[i].frame_size);
+			write_int32(ofp, table[i].stack_depth);
+		}
+	write_int32(ofp, code_index);
+	for (i = 0; i < code_index; i++)
+	{
+		write_int32(ofp, code[i].op);
+		write_int32(ofp, code[i].l);
+		write_int32(ofp, code[i].m);
 	}
+	trace_end("write code image");
+}
 
-	// call mark
-	mark();
-
-	// decrement level
-	level--;
+// little endian regardless of the host
+void write_int32(FILE *ofp, int value)
+{
+	uint32_t bits = value;
+	fputc(bits & 0xff, ofp);
+	fputc(bits >> 8 & 0xff, ofp);
+	fputc(bits >> 16 & 0xff, ofp);
+	fputc(bits >> 24 & 0xff, ofp);
+}
 
-	//printf("end block\n");
+// names go out as IDENTIFIER_LENGTH bytes, zero padded
+void write_name(FILE *ofp, const char *name)
+{
+	char padded[IDENTIFIER_LENGTH] = { 0 };
+	size_t length = strlen(name);
 
-	// END OF BLOCK()
+	memcpy(padded, name, length < IDENTIFIER_LENGTH ? length : IDENTIFIER_LENGTH - 1);
+	fwrite(padded, 1, IDENTIFIER_LENGTH, ofp);
 }
 
-// declarations function
-int declarations() {
+// writes a program compiled in module mode as a relocatable object, see 
+// 		parser.h for the layout. the top level procedures are its exports
+void write_object(FILE *ofp)
+{
+	procedure_range *ranges = compile_allocate(table_index * sizeof(procedure_range));
+	int *kinds = compile_allocate((code_index + 1) * sizeof(int));
+	int *externals = compile_allocate((code_index + 1) * sizeof(int));
+	int count = find_procedures(ranges);
+	int main_start = table[0].address / 3;
+	int relocation_count = 0;
+	int export_count = 0;
+	int block_level;
+	int r;
+	int i;
 
-	//printf("start declarations\n");
+	trace_begin("write object", -1, 0);
 
-	// set num of variables declared to 0
-	int number_of_variables_declared = 0;
+	// the JMP to main isn't in any range, the linker writes its own
+	for (i = 0; i < code_index; i++)
+		kinds[i] = -1;
+	for (r = 0; r < count; r++)
+	{
+		block_level = procedure_block_level(ranges[r].symbol);
+		for (i = ranges[r].first; i <= ranges[r].last; i++)
+		{
+			kinds[i] = relocation_kind_at(i, block_level, &externals[i]);
+			if (kinds[i] != -1)
+				relocation_count++;
+		}
+	}
+	for (i = 1; i < table_index; i++)
+		if (table[i].kind == 3 && table[i].level == 0 && table[i].address >= 0)
+			export_count++;
+
+	fwrite(OBJECT_MAGIC, 1, 4, ofp);
+	write_int32(ofp, OBJECT_VERSION);
+	write_int32(ofp, code[main_start].op == INC ? code[main_start].m - 3 : 0);
+	write_int32(ofp, main_start);
+	write_int32(ofp, export_count);
+	for (i = 1; i < table_index; i++)
+		if (table[i].kind == 3 && table[i].level == 0 && table[i].address >= 0)
+		{
+			write_name(ofp, table[i].name);
+			write_int32(ofp, table[i].address / 3);
+		}
+	write_int32(ofp, external_count);
+	for (i = 0; i < external_count; i++)
+		write_name(ofp, external_names[i]);
+	write_int32(ofp, relocation_count);
+	for (i = 0; i < code_index; i++)
+		if (kinds[i] != -1)
+		{
+			write_int32(ofp, i);
+			write_int32(ofp, kinds[i]);
+			write_int32(ofp, externals[i]);
+		}
+	write_int32(ofp, code_index);
+	for (i = 0; i < code_index; i++)
+	{
+		write_int32(ofp, code[i].op);
+		write_int32(ofp, code[i].l);
+		write_int32(ofp, code[i].m);
+	}
+	trace_end("write object");
+}
 
-	// while current token == keyword_const || keyword_var
-	while(tokens[token_index].type == keyword_const || keyword_var ){
+// what the linker has to patch in the instruction at index, which sits in a 
+// 		procedure whose body is at block_level, -1 for nothing. an access 
+// 		that walks all block_level static links lands in main's frame
+int relocation_kind_at(int index, int block_level, int *external)
+{
+	instruction *ir = &code[index];
 
-		// if current token == keyword_const
-		if(tokens[token_index].type == keyword_const){
+	*external = -1;
+	switch (ir->op)
+	{
+		case JMP :
+		case JPC :
+		case CJP :
+		case CAL :
+		case TCL :
+			if (ir->m >= 0)
+				return relocate_code;
+			*external = -ir->m / 3 - 1;
+			return relocate_external;
+		case LDG :
+		case STG :
+			return relocate_global;
+		case LOD :
+		case STO :
+		case CPY :
+			return ir->l == block_level ? relocate_global : -1;
+		default :
+			return -1;
+	}
+}
 
-			//printf("declarations before constants\n");
+// prepares this thread's compiler for a new input, numbers pooled for the 
+// 		previous input are dropped, interned identifiers stay for good
+void begin_compilation(void)
+{
+	// everything below lived in the arena, so dropping it is just forgetting it
+	arena_reset(&compile_arena);
+	forget_compiler_storage();
+	reserve_tokens(0);
+	reset_parser_state();
+	reserve_trace_buffer();
+}
+
+// drops this thread's pointers into the arena
+void forget_compiler_storage()
+{
+	tokens = NULL;
+	number_pool = NULL;
+	table = NULL;
+	code = NULL;
+	code_sources = NULL;
+	sources = NULL;
+	source_map = NULL;
+	ir_nodes = NULL;
+	ir_blocks = NULL;
+	ir_procedures = NULL;
+	expression_nodes = NULL;
+	external_names = NULL;
+	diagnostics = NULL;
+	token_count = token_capacity = 0;
+	number_count = number_capacity = 0;
+	memset(&lexeme_info, 0, sizeof(lexeme_info));
+	lexeme_info.invalid_lexeme = -1;
+	table_capacity = code_capacity = code_source_capacity = 0;
+	source_count = source_capacity = source_map_length = 0;
+	ir_node_count = ir_node_capacity = 0;
+	ir_block_count = ir_block_capacity = 0;
+	ir_procedure_count = ir_procedure_capacity = 0;
+	expression_node_count = expression_node_capacity = 0;
+	external_count = external_capacity = 0;
+	diagnostic_count = diagnostic_capacity = 0;
+}
+
+// parses count lexemes whose numbers were pooled on this thread since 
+// 		begin_compilation(), identifiers can come from any thread. returns 
+// 		-1 on an error
+int compile_lexemes(const lexeme *input, int count, compile_result *result)
+{
+	jmp_buf recovery;
+	jmp_buf *outer = allocation_recovery;
+	int i;
+
+	if (setjmp(recovery) != 0)
+	{
+		allocation_recovery = outer;
+		fill_out_of_memory_result(result);
+		return -1;
+	}
+	allocation_recovery = &recovery;
+
+	// anything the parser can't look up stops here, before it is copied
+	trace_begin("validate", -1, 0);
+	validate_lexemes(input, count, &lexeme_info);
+	trace_end("validate");
+	if (lexeme_info.invalid_lexeme != -1)
+	{
+		reset_parser_state();
+		token_index = lexeme_info.invalid_lexeme;
+		lexer_error(6);
+		error = -1;
+		fill_compile_result(result);
+		allocation_recovery = outer;
+		return error;
+	}
+
+	// input may already be our own token array when called from the front ends
+	if (input != tokens)
+	{
+		token_count = 0;
+		reserve_tokens(count);
+		for (i = 0; i < count; i++)
+			add_token(input[i].type, input[i].payload);
+	}
+
+	reset_parser_state();
+	trace_begin("program", -1, 0);
+	program();
+	trace_end("program");
+	if (error != -1)
+	{
+		trace_begin("optimize", -1, 0);
+		optimize_program();
+		compute_stack_depths();
+		trace_end("optimize");
+		build_source_map();
+	}
+	else
+	{
+		// procedures lowered before the error don't make a program
+		code_index = 0;
+	}
+
+	fill_compile_result(result);
+	allocation_recovery = outer;
+	return error;
+}
+
+// the result of a compilation abandoned by out_of_memory(), nothing in the 
+// 		arena can be trusted so it is dropped and the one error lives here
+void fill_out_of_memory_result(compile_result *result)
+{
+	static _Thread_local diagnostic failure;
+
+	arena_reset(&compile_arena);
+	forget_compiler_storage();
+	code_index = table_index = 0;
+	error = -1;
+	failure.kind = parser_diagnostic;
+	failure.error_code = 20;
+	failure.case_code = 0;
+	failure.token_index = token_index;
+	diagnostics = &failure;
+	diagnostic_count = 1;
+	fill_compile_result(result);
+}
+
+// points result at this thread's code, table and diagnostics
+void fill_compile_result(compile_result *result)
+{
+	result->code = code;
+	result->code_length = code_index;
+	result->max_stack_depth = max_stack_depth;
+	result->table = table;
+	result->table_length = table_index;
+	result->diagnostics = diagnostics;
+	result->diagnostic_count = diagnostic_count;
+	result->source_map = source_map;
+	result->source_map_length = source_map_length;
+	result->lexemes = lexeme_info;
+}
+
+// compiles the numeric token text format, the same as the cli's default input
+int compile_token_text(const char *text, int length, compile_result *result)
+{
+	jmp_buf recovery;
+	jmp_buf *outer = allocation_recovery;
+	int read;
+
+	if (setjmp(recovery) != 0)
+	{
+		allocation_recovery = outer;
+		fill_out_of_memory_result(result);
+		return -1;
+	}
+	allocation_recovery = &recovery;
+
+	begin_compilation();
+	trace_begin("read tokens", -1, 0);
+	read = read_token_text(text, length);
+	trace_end("read tokens");
+	if (read == -1)
+	{
+		error = -1;
+		fill_compile_result(result);
+	}
+	else
+		compile_lexemes(tokens, token_count, result);
+	allocation_recovery = outer;
+	return error;
+}
+
+// compiles PL/0 source with the built in lexer
+int compile_source(const char *source, int length, compile_result *result)
+{
+	jmp_buf recovery;
+	jmp_buf *outer = allocation_recovery;
+	int lexed;
+
+	if (setjmp(recovery) != 0)
+	{
+		allocation_recovery = outer;
+		fill_out_of_memory_result(result);
+		return -1;
+	}
+	allocation_recovery = &recovery;
+
+	begin_compilation();
+	trace_begin("lex", -1, 0);
+	lexed = lex_source(source, length);
+	trace_end("lex");
+	if (lexed == -1)
+	{
+		error = -1;
+		fill_compile_result(result);
+	}
+	else
+		compile_lexemes(tokens, token_count, result);
+	allocation_recovery = outer;
+	return error;
+}
+
+// frees this thread's compiler storage, a later compilation reallocates it
+void release_compiler_state(void)
+{
+	arena_release(&compile_arena);
+	forget_compiler_storage();
+}
+
+// picks the optimization passes this thread's later compilations run
+void set_optimizations(int flags)
+{
+	optimizations = flags;
+}
+
+// largest procedure body, not counting INC and RTN, that inlining copies
+void set_inline_limit(int instructions)
+{
+	inline_limit = instructions;
+}
+
+// compiles later inputs on this thread as modules for write_object()
+void set_module_mode(bool enabled)
+{
+	module_mode = enabled;
+}
+
+// allocation counters for this thread's compiler arena
+void get_allocation_stats(allocation_stats *stats)
+{
+	*stats = compile_arena.stats;
+}
+
+// turns tracing on for the rest of the process
+void start_tracing(void)
+{
+	tracing = true;
+}
+
+// prints every thread's events, timestamps are microseconds from the 
+// earliest event and each thread gets its own track
+void write_trace(FILE *ofp)
+{
+	trace_buffer *buffer;
+	long long start = -1;
+	bool first = true;
+	int i;
+
+	for (buffer = atomic_load(&trace_buffers); buffer != NULL; buffer = buffer->next)
+		if (buffer->count > 0 && (start == -1 || buffer->events[0].time < start))
+			start = buffer->events[0].time;
+
+	fprintf(ofp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	for (buffer = atomic_load(&trace_buffers); buffer != NULL; buffer = buffer->next)
+	{
+		fprintf(ofp, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+			"\"args\": {\"name\": \"compiler %d\", \"dropped\": %ld}}", 
+			first ? "" : ",", buffer->thread, buffer->thread, buffer->dropped);
+		first = false;
+		for (i = 0; i < buffer->count; i++)
+		{
+			trace_event *event = &buffer->events[i];
+			fprintf(ofp, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f", 
+				event->name, event->phase, buffer->thread, (event->time - start) / 1000.0);
+			if (event->procedure[0] != '\0')
+				fprintf(ofp, ", \"args\": {\"procedure\": \"%s\", \"level\": %d}", event->procedure, event->level);
+			fprintf(ofp, "}");
+		}
+	}
+	fprintf(ofp, "\n]}\n");
+}
+
+// gives this thread its event buffer the first time it compiles with 
+// tracing on, so recording an event never allocates
+void reserve_trace_buffer()
+{
+	trace_buffer *buffer;
+
+	if (!tracing || thread_trace != NULL)
+		return;
+	buffer = malloc(sizeof(trace_buffer) + TRACE_EVENTS * sizeof(trace_event));
+	if (buffer == NULL)
+		return;
+	buffer->thread = atomic_fetch_add(&trace_threads, 1);
+	buffer->count = 0;
+	buffer->dropped = 0;
+	buffer->next = atomic_load(&trace_buffers);
+	while (!atomic_compare_exchange_weak(&trace_buffers, &buffer->next, buffer))
+		;
+	thread_trace = buffer;
+}
+
+// a phase of the given procedure starts, symbol_index is -1 if the phase 
+// isn't about one
+void trace_begin(const char *name, int symbol_index, int block_level)
+{
+	if (tracing)
+		record_trace_event('B', name, symbol_index, block_level);
+}
+
+// the phase this thread began last ends
+void trace_end(const char *name)
+{
+	if (tracing)
+		record_trace_event('E', name, -1, 0);
+}
+
+void record_trace_event(char phase, const char *name, int symbol_index, int block_level)
+{
+	trace_event *event;
+
+	reserve_trace_buffer();
+	if (thread_trace == NULL)
+		return;
+	if (thread_trace->count == TRACE_EVENTS)
+	{
+		thread_trace->dropped++;
+		return;
+	}
+	event = &thread_trace->events[thread_trace->count++];
+	event->name = name;
+	event->phase = phase;
+	event->level = block_level;
+	if (symbol_index != -1)
+		memcpy(event->procedure, table[symbol_index].name, IDENTIFIER_LENGTH);
+	else
+		event->procedure[0] = '\0';
+	event->time = trace_clock();
+}
+
+// nanoseconds on the monotonic clock
+long long trace_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// clears everything program() produces, leaving the tokens alone
+void reset_parser_state()
+{
+	// the table always keeps a spare row, constants() writes a name into it 
+	// before calling add_symbol()
+	table = grow_array(table, &table_capacity, 1, sizeof(symbol));
+	code = grow_array(code, &code_capacity, 1, sizeof(instruction));
+	token_index = 0;
+	table_index = 0;
+	code_index = 0;
+	max_stack_depth = 0;
+	source_count = 0;
+	source_map_length = 0;
+	current_source = -1;
+	ir_node_count = 0;
+	ir_block_count = 0;
+	ir_procedure_count = 0;
+	ir_lowered_count = 0;
+	ir_next_address = 1;
+	external_count = 0;
+	diagnostic_count = 0;
+	error = 0;
+	level = 0;
+}
+
+// program function
+void program() {
+
+	//printf("start program\n");
+
+	// add symbol to end of table
+	add_symbol(3, "main", 0, 0, 0);
+
+	// set level to -1
+	level = -1;
+
+	//printf("program before block\n");
+
+	// call block()
+	trace_begin("block", 0, 0);
+	block();
+	trace_end("block");
+
+	//printf("program after block\n");
+
+	// if error, stop execution
+	if(error == -1) {
+		return;
+	}
+
+	//printf("%d\n", token_index);
+
+	// if current token != period
+	if(token_type_at(token_index) != period) {
+
+		// error 1, return
+		parser_error(1, 0);
+
+		// error = -1;
+		error = -1;
+
+		// stop execution
+		return;
+	}
+	
+	// emit HLT, L = 0
+	emit(SYS, 0, HLT);
+
+	// main is finished too, whatever was still waiting gets lowered
+	ir_finish_program();
+
+	// END OF PROGRAM()
+}
+
+// block function
+void block() {
+	// the very last symbol added to the symbol table was the current procedure, 
+	// whether this was main or a subprocedure, we need to save where the procedure
+	//  is in the symbol table before we add more symbols, so we can use it to set 
+	// the address before we emit code in statement
+	int procedure_index = table_index - 1;
+
+	// INC and RTN are charged to the whole block
+	int block_source = add_source(procedure_index, true);
+
+	//printf("block before declarations\n");
+
+	// increment level
+	level++;
+
+	// inc_m_value to declarations call
+	int inc_m_value = declarations();
+
+	// if error, return
+	if(inc_m_value == -1) {
+		error = -1;
+		return;
+	}
+
+	//printf("block before procedures\n");
+
+	trace_begin("procedures", procedure_index, level);
+	procedures();
+	trace_end("procedures");
+
+	// once we emit INC, we'll be emitting code so this is where the procedure starts, 
+	// ir_begin_procedure() gives it the address right after the last procedure
+	ir_begin_procedure(procedure_index, block_source);
+
+	// emit() INC (m = inc_m_value)
+	emit(INC, 0, inc_m_value);
+
+	//printf("block before state\n");
+
+	// call statement
+	statement();
+
+	//printf("block after state\n");
+
+	// if error, return
+	if(error == -1) {
+		return;
+	}
+
+	sources[block_source].last_token = token_index - 1;
+
+	// call mark
+	mark();
+
+	// decrement level
+	level--;
+
+	//printf("end block\n");
+
+	// END OF BLOCK()
+}
+
+// declarations function
+int declarations() {
+
+	//printf("start declarations\n");
+
+	// set num of variables declared to 0
+	int number_of_variables_declared = 0;
+
+	// while current token == keyword_const || keyword_var
+	while(token_type_at(token_index) == keyword_const || keyword_var ){
+
+		// if current token == keyword_const
+		if(token_type_at(token_index) == keyword_const){
+
+			//printf("declarations before constants\n");
 
 			// call constants
 			constants();
@@ -276,7 +1939,7 @@ int declarations() {
 		}
 		
 		// else
-		else if(tokens[token_index].type == keyword_var){
+		else if(token_type_at(token_index) == keyword_var){
 
 			//printf("declarations before var\n");
 
@@ -319,10 +1982,10 @@ void constants() {
 	token_index++;
 
 	// if current token != identifier
-	if(tokens[token_index].type != identifier) {
+	if(token_type_at(token_index) != identifier) {
 
 		// error 2-1, return
-		print_parser_error(2, 1);
+		parser_error(2, 1);
 
 		// set error flag to -1
 		error = -1;
@@ -333,13 +1996,13 @@ void constants() {
 	}
 	
 	// if (multiple_declaration_check(identifier_name) != -1)
-	if(multiple_declaration_check(tokens[token_index].identifier_name) != -1) {
+	if(multiple_declaration_check(token_name(token_index)) != -1) {
 
 		// this means that the identifier name has already been used by another 
 		// symbol in this procedure
 
 		// error 3, return
-		print_parser_error(3, 0);
+		parser_error(3, 0);
 
 		// set error flag to -1
 		error = -1;
@@ -350,16 +2013,16 @@ void constants() {
 	}
 	
 	// save the identifier_name for the symbol name
-	strcpy(table[table_index].name, tokens[token_index].identifier_name);
+	strcpy(table[table_index].name, token_name(token_index));
 
 	// move to next token
 	token_index++;
 
 	// if current token != assignment_symbol
-	if(tokens[token_index].type != assignment_symbol){
+	if(token_type_at(token_index) != assignment_symbol){
 
 		// error 4-1, return
-		print_parser_error(4, 1);
+		parser_error(4, 1);
 
 		// set error flag to -1
 		error = -1;
@@ -373,7 +2036,7 @@ void constants() {
 	token_index++;
 	
 	// if current token == minus
-	if(tokens[token_index].type == minus){
+	if(token_type_at(token_index) == minus){
 
 		// set minus_flag to true
 		minus_flag = true;
@@ -384,10 +2047,10 @@ void constants() {
 	}
 
 	// if current token != number
-	if(tokens[token_index].type != number) {
+	if(token_type_at(token_index) != number) {
 
 		// error 5, return
-		print_parser_error(5, 0);
+		parser_error(5, 0);
 
 		// set error flag to -1
 		error = -1;
@@ -398,7 +2061,7 @@ void constants() {
 	}
 
 	// save number_value for symbol table
-	table[table_index].value = tokens[token_index].number_value;
+	table[table_index].value = token_number(token_index);
 
 	// move to next token
 	token_index++;
@@ -414,10 +2077,10 @@ void constants() {
 	add_symbol(1, table[table_index].name, table[table_index].value, level, 0);
 
 	// if current token != semicolon
-	if(tokens[token_index].type != semicolon){
+	if(token_type_at(token_index) != semicolon){
 
 		// error 6-1, return
-		print_parser_error(6, 1);
+		parser_error(6, 1);
 
 		// set error flag to -1
 		error = -1;
@@ -440,16 +2103,16 @@ void variables(int numVars) {
 
 	//printf("begin var\n");
 
-	//printf("%d\n", tokens[token_index].type);
+	//printf("%d\n", token_type_at(token_index));
 
 	// move to next token
 	token_index++;
 
 	// if current token != identifier
-	if(tokens[token_index].type != identifier){
+	if(token_type_at(token_index) != identifier){
 
 		// error 2-2, return
-		print_parser_error(2, 2);
+		parser_error(2, 2);
 
 		// set error flag to -1
 		error = -1;
@@ -460,13 +2123,13 @@ void variables(int numVars) {
 	}
 
 	// if multiple_declaration_check(identifier_name) != -1
-	if(multiple_declaration_check(tokens[token_index].identifier_name) != -1){
+	if(multiple_declaration_check(token_name(token_index)) != -1){
 
 		// this means that the identifier name has already been used 
 		// by another symbol in this procedure
 
 		// error 3, return
-		print_parser_error(3, 0);
+		parser_error(3, 0);
 
 		// set error flag to -1
 		error = -1;
@@ -477,7 +2140,7 @@ void variables(int numVars) {
 	}
 	
 	// save the identifier_name for the symbol name
-	strcpy(table[table_index].name, tokens[token_index].identifier_name);
+	strcpy(table[table_index].name, token_name(token_index));
 
 	// move to next token
 	token_index++;
@@ -489,10 +2152,10 @@ void variables(int numVars) {
 	add_symbol(2, table[table_index].name, 0, level, numVars + 3);
 
 	// if current token != semicolon
-	if(tokens[token_index].type != semicolon){
+	if(token_type_at(token_index) != semicolon){
 
 		// error 6-2, return
-		print_parser_error(6, 2);
+		parser_error(6, 2);
 
 		// set error flag to -1
 		error = -1;
@@ -516,16 +2179,16 @@ void procedures() {
 	//printf("start proc\n");
 
 	// while current token == keyword_procedure
-	while(tokens[token_index].type == keyword_procedure){
+	while(token_type_at(token_index) == keyword_procedure){
 
 		// move to next token
 		token_index++;
 
 		// if current token != identifier
-		if(tokens[token_index].type != identifier){
+		if(token_type_at(token_index) != identifier){
 
 			// error 2-3, return
-			print_parser_error(2, 3);
+			parser_error(2, 3);
 
 			// set error flag to -1
 			error = -1;
@@ -536,13 +2199,13 @@ void procedures() {
 		}
 
 		// if multiple_declaration_check(identifier_name) != -1
-		if(multiple_declaration_check(tokens[token_index].identifier_name) != -1){
+		if(multiple_declaration_check(token_name(token_index)) != -1){
 
 			// this means that the identifier name has already 
 			// been used by another symbol in this procedure
 
 			// error 3, return
-			print_parser_error(3, 0);
+			parser_error(3, 0);
 
 			// set error flag to -1
 			error = -1;
@@ -553,7 +2216,7 @@ void procedures() {
 		}
 
 		// save the identifier_name for the symbol name
-		strcpy(table[table_index].name, tokens[token_index].identifier_name);
+		strcpy(table[table_index].name, token_name(token_index));
 		
 		// move to next token
 		token_index++;
@@ -562,10 +2225,10 @@ void procedures() {
 		add_symbol(3, table[table_index].name, 0, level, 0);
 
 		// if current token != left_curly_brace
-		if(tokens[token_index].type != left_curly_brace) {
+		if(token_type_at(token_index) != left_curly_brace) {
 
 			// error 14, return
-			print_parser_error(14, 0);
+			parser_error(14, 0);
 
 			// set error flag to -1
 			error = -1;
@@ -581,7 +2244,9 @@ void procedures() {
 		//printf("proc before block\n");
 
 		// block();
+		trace_begin("block", table_index - 1, level + 1);
 		block();
+		trace_end("block");
 
 		// if error, return
 		if(error == -1) {
@@ -592,10 +2257,10 @@ void procedures() {
 		emit(OPR, 0, RTN);
 
 		// if current token != right_curly_brace
-		if(tokens[token_index].type != right_curly_brace){
+		if(token_type_at(token_index) != right_curly_brace){
 
 			// error 15, return
-			print_parser_error(15, 0);
+			parser_error(15, 0);
 
 			// set error flag to -1
 			error = -1;
@@ -615,24 +2280,34 @@ void procedures() {
 	// END OF PROCEDURES()
 }
 
-// statement function
+// statement function, everything parse_statement() emits is charged to the 
+// 		innermost statement it is part of
 void statement() {
+	int outer = current_source;
+
+	current_source = add_source(ir_procedures[ir_procedure_count - 1].symbol, false);
+	parse_statement();
+	sources[current_source].last_token = token_index - 1;
+	current_source = outer;
+}
+
+void parse_statement() {
 
 	//printf("start state\n");
 
 	//printf("%d\n", token_index);
 
 	// if current token == keyword_def
-	if(tokens[token_index].type == keyword_def){
+	if(token_type_at(token_index) == keyword_def){
 
 		// move to next token
 		token_index++;
 
 		// if current token != identifier
-		if(tokens[token_index].type != identifier){
+		if(token_type_at(token_index) != identifier){
 
 			// error 2-6, return
-			print_parser_error(2, 6);
+			parser_error(2, 6);
 
 			// set error flag to -1
 			error = -1;
@@ -642,19 +2317,19 @@ void statement() {
 
 		}
 
-		int symbol_index_in_table = find_symbol(tokens[token_index].identifier_name, 2);
+		int symbol_index_in_table = find_symbol(token_name(token_index), 2);
 		
 		// if symbol_index_in_table == -1 // couldn't find it
 		if(symbol_index_in_table == -1) {
 
 			// if find_symbol(identifier_name, 1) == find_symbol(identifier_name, 3);
-			if(find_symbol(tokens[token_index].identifier_name, 1) == find_symbol(tokens[token_index].identifier_name, 3)) {
+			if(find_symbol(token_name(token_index), 1) == find_symbol(token_name(token_index), 3)) {
 
 				// this will only be true if there isn’t a constant AND there 
 				// isn’t a procedure with the desired name
 
 				// error 8-1, return
-				print_parser_error(8, 1);
+				parser_error(8, 1);
 
 				// set error flag to -1
 				error = -1;
@@ -668,7 +2343,7 @@ void statement() {
 			else{
 
 				// error 7, return
-				print_parser_error(7, 0);
+				parser_error(7, 0);
 
 				// set error flag to -1
 				error = -1;
@@ -684,10 +2359,10 @@ void statement() {
 		token_index++;
 
 		// if current token != assignment_symbol
-		if(tokens[token_index].type != assignment_symbol){
+		if(token_type_at(token_index) != assignment_symbol){
 
 			// error 4-2, return
-			print_parser_error(4, 2);
+			parser_error(4, 2);
 
 			// set error flag to -1
 			error = -1;
@@ -700,10 +2375,10 @@ void statement() {
 		// move to next token
 		token_index++;
 
-		//printf("state before factor\n");
+		//printf("state before expression\n");
 
-		// factor();
-		factor();
+		// expression();
+		expression();
 
 		// if error, return
 		if(error == -1) {
@@ -711,21 +2386,21 @@ void statement() {
 		}
 
 		// emit() STO, L = level, m = symbol's address from table
-		emit(STO, level - table[symbol_index_in_table].level, table[symbol_index_in_table].address);
+		emit_variable_access(STO, symbol_index_in_table);
 
 	}
 
 	// else if current token == keyword_call
-	else if (tokens[token_index].type == keyword_call){
+	else if (token_type_at(token_index) == keyword_call){
 
 		// move to next token
 		token_index++;
 
 		// if current token != identifier
-		if(tokens[token_index].type != identifier){
+		if(token_type_at(token_index) != identifier){
 
 			// error 2-4, return
-			print_parser_error(2, 4);
+			parser_error(2, 4);
 
 			// set error flag to -1
 			error = -1;
@@ -736,19 +2411,24 @@ void statement() {
 		}
 
 		// symbol_index_in_table = find_symbol(identifier_name, 3)
-		int symbol_index_in_table = find_symbol(tokens[token_index].identifier_name, 3);
+		int symbol_index_in_table = find_symbol(token_name(token_index), 3);
+
+		// a module leaves procedures it doesn't declare to the linker
+		if(symbol_index_in_table == -1 && module_mode && 
+			find_symbol(token_name(token_index), 1) == find_symbol(token_name(token_index), 2))
+			symbol_index_in_table = declare_external(token_name(token_index));
 
 		// if symbol_index_in_table == -1 // we couldn't find it
 		if(symbol_index_in_table == -1) {
 
 			// if find_symbol(indtifier_name, 1) == find_symbol(identifier_name, 2)
-			if(find_symbol(tokens[token_index].identifier_name, 1) == find_symbol(tokens[token_index].identifier_name, 2)){
+			if(find_symbol(token_name(token_index), 1) == find_symbol(token_name(token_index), 2)){
 
 				// this will only be true if there isn’t a constant AND 
 				// there isn’t a variable with the desired name
 
 				// error 8-2, return
-				print_parser_error(8, 2);
+				parser_error(8, 2);
 
 				// set error flag to -1
 				error = -1;
@@ -762,7 +2442,7 @@ void statement() {
 			else{
 
 				// error 9, return
-				print_parser_error(9, 0);
+				parser_error(9, 0);
 
 				// set error flag to -1
 				error = -1;
@@ -777,17 +2457,17 @@ void statement() {
 		// move to next token
 		token_index++;
 
-		// emit CAl, L = level, m = symbol_index_in_table
-		emit(CAL, level, symbol_index_in_table);
+		// emit CAL naming the procedure's symbol
+		emit_call(symbol_index_in_table);
 
 		// we do this because our procedure may not have been defined yet, 
-		// and this way we can go back later, find it in the table, and get
+		// and this way lower_procedure() can find it in the table and get
 	 	// the address after they’ve all been defined
 
 	}
 
 	// else if current token == keyword_begin
-	else if(tokens[token_index].type == keyword_begin){
+	else if(token_type_at(token_index) == keyword_begin){
 
 		// do 
 		do{
@@ -806,20 +2486,20 @@ void statement() {
 		}
 		
 		// while current token == semicolon
-		while(tokens[token_index].type == semicolon);
+		while(token_type_at(token_index) == semicolon);
 
 		// if current token != keyword_end
-		if(tokens[token_index].type != keyword_end){
+		if(token_type_at(token_index) != keyword_end){
 
 			// if current token == identifier || keyword_call ||
 			// keyword_begin || keyword_read || keyword_def
-			if(tokens[token_index].type == identifier || keyword_call || keyword_begin || keyword_read || keyword_def){
+			if(token_type_at(token_index) == identifier || keyword_call || keyword_begin || keyword_read || keyword_def){
 
 				// this means that there was a semicolon missing 
 				// between two statements
 
 				// error 6-3, return
-				print_parser_error(6, 3);
+				parser_error(6, 3);
 
 				// set error flag to -1
 				error = -1;
@@ -833,7 +2513,7 @@ void statement() {
 			else {
 
 				// error 10, return
-				print_parser_error(10, 0);
+				parser_error(10, 0);
 
 				// set error flag to -1
 				error = -1;
@@ -851,16 +2531,16 @@ void statement() {
 	}
 		
 		// else if current token == keyword_read
-		else if(tokens[token_index].type == keyword_read){
+		else if(token_type_at(token_index) == keyword_read){
 
 			// move to next token
 			token_index++;
 
 			// if current token != identifier
-			if(tokens[token_index].type != identifier){
+			if(token_type_at(token_index) != identifier){
 
 				// error 2-5, return
-				print_parser_error(2, 5);
+				parser_error(2, 5);
 
 				// set error flag to -1
 				error = -1;
@@ -870,12 +2550,12 @@ void statement() {
 
 			}
 
-			//printf("%s\n", tokens[token_index].identifier_name);
+			//printf("%s\n", token_name(token_index));
 			//printf("%s\n", table[1].name);
 			//printf("%d\n", table[1].kind);
 
 			// symbol_index_in_table = find_symbol(identifier_name, 2);
-			int symbol_index_in_table = find_symbol(tokens[token_index].identifier_name, 2);
+			int symbol_index_in_table = find_symbol(token_name(token_index), 2);
 			//printf("%d\n", symbol_index_in_table);
 
 
@@ -883,13 +2563,13 @@ void statement() {
 			if(symbol_index_in_table == -1){
 
 				// if find_symbol(identifier_name, 1) == find_symbol(identifier_name, 3)
-				if(find_symbol(tokens[token_index].identifier_name, 1) == find_symbol(tokens[token_index].identifier_name, 3)){
+				if(find_symbol(token_name(token_index), 1) == find_symbol(token_name(token_index), 3)){
 
 					// this will only be true if there isn’t a constant AND 
 					// there isn’t a procedure with the desired name
 
 					// error 8-3, return
-					print_parser_error(8, 3);
+					parser_error(8, 3);
 
 					// set error flag to -1
 					error = -1;
@@ -903,7 +2583,7 @@ void statement() {
 				else {
 
 					// error 13, return
-					print_parser_error(13, 0);
+					parser_error(13, 0);
 
 					// set error flag to -1
 					error = -1;
@@ -922,50 +2602,353 @@ void statement() {
 			emit(SYS, 0, RED);
 
 			// emit STO, L = level, M = symbol's address from table
-			emit(STO, level - table[symbol_index_in_table].level, table[symbol_index_in_table].address);
+			emit_variable_access(STO, symbol_index_in_table);
 
 		}
 
-	//printf("%d\n", token_index);
+	// else if current token == keyword_if
+	else if(token_type_at(token_index) == keyword_if){
 
-	//printf("end of state\n");
+		// move to next token
+		token_index++;
 
-	// END OF STATEMENT()
-}
+		// relation = condition();
+		int relation = condition();
 
-// factor function
-void factor() {
+		// if error, return
+		if(error == -1) {
+			return;
+		}
 
-	//printf("start of factor\n");
+		// if current token != keyword_then
+		if(token_type_at(token_index) != keyword_then){
 
-	// if current token == identifier
-	if(tokens[token_index].type == identifier){
+			// error 11, return
+			parser_error(11, 0);
 
-		// constant_index = find_symbol(indentifier_name, 1);
-		int constant_index = find_symbol(tokens[token_index].identifier_name, 1);
+			// set error flag to -1
+			error = -1;
 
-		// variable_index = find_symbol(indentifier_name, 2);
-		int variable_index = find_symbol(tokens[token_index].identifier_name, 2);
+			// return
+			return;
 
-		// if (constant_index == variable_index)
-		if(constant_index == variable_index) {
+		}
 
-			// this will only happen if there wasn’t a constant 
-			// AND there wasn’t a variable with the desired name
+		// move to next token
+		token_index++;
 
-			// if find_symbol(identifier_name, 3) != -1
-			if(find_symbol(tokens[token_index].identifier_name, 3) != -1){
+		// the jump past the then part, patched once we know where that is
+		int false_jumps = emit_branch(relation, -1);
 
-				// there is a valid procedure
+		// statement();
+		statement();
 
-				// error 17, return
-				print_parser_error(17, 0);
+		// if error, return
+		if(error == -1) {
+			return;
+		}
 
-				// set error flag to -1
-				error = -1;
+		// if current token == keyword_else
+		if(token_type_at(token_index) == keyword_else){
 
-				// return
+			// move to next token
+			token_index++;
+
+			// the then part jumps over the else part, which is where a 
+			// false condition goes
+			int end_jumps = ir_jump(JMP, -1);
+			ir_patch_jumps(false_jumps, ir_label());
+
+			// statement();
+			statement();
+
+			// if error, return
+			if(error == -1) {
 				return;
+			}
+
+			ir_patch_jumps(end_jumps, ir_label());
+
+		}
+
+		// else a false condition skips to whatever comes after
+		else
+			ir_patch_jumps(false_jumps, ir_label());
+
+	}
+
+	// else if current token == keyword_while
+	else if(token_type_at(token_index) == keyword_while){
+
+		// move to next token
+		token_index++;
+
+		int top = ir_label();
+
+		// relation = condition(), remembering the nodes it emitted
+		int condition_first = ir_node_count;
+		int relation = condition();
+		int condition_end = ir_node_count;
+
+		// if error, return
+		if(error == -1) {
+			return;
+		}
+
+		// if current token != keyword_do
+		if(token_type_at(token_index) != keyword_do){
+
+			// error 12, return
+			parser_error(12, 0);
+
+			// set error flag to -1
+			error = -1;
+
+			// return
+			return;
+
+		}
+
+		// move to next token
+		token_index++;
+
+		// the jump out of the loop, patched once the body is done
+		int exit_jumps = emit_branch(relation, -1);
+		int body = ir_label();
+
+		// statement();
+		statement();
+
+		// if error, return
+		if(error == -1) {
+			return;
+		}
+
+		// with -fbranches the condition is tested again at the bottom, 
+		// negated, so an iteration takes one branch back to the body 
+		// instead of a JMP to the top and a JPC that doesn't jump
+		if(optimizations & optimize_branches){
+			ir_copy_nodes(condition_first, condition_end);
+			ir_patch_jumps(emit_branch(negate_relation(relation), -1), body);
+		}
+
+		// else the body jumps back up to the condition
+		else
+			ir_patch_jumps(ir_jump(JMP, -1), top);
+
+		ir_patch_jumps(exit_jumps, ir_label());
+
+	}
+
+	//printf("%d\n", token_index);
+
+	//printf("end of state\n");
+
+	// END OF STATEMENT()
+}
+
+// condition function, emits both operands and returns the relational OPR 
+// 		that compares them for the caller to branch on
+int condition() {
+
+	// expression();
+	expression();
+
+	// if error, return
+	if(error == -1) {
+		return -1;
+	}
+
+	// relation = the OPR for the current token
+	int relation;
+	switch(token_type_at(token_index)) {
+		case equal_to : relation = EQL; break;
+		case not_equal_to : relation = NEQ; break;
+		case less_than : relation = LSS; break;
+		case less_than_or_equal_to : relation = LEQ; break;
+		case greater_than : relation = GTR; break;
+		case greater_than_or_equal_to : relation = GEQ; break;
+		default :
+
+			// error 16, return
+			parser_error(16, 0);
+
+			// set error flag to -1
+			error = -1;
+
+			// return
+			return -1;
+	}
+
+	// move to next token
+	token_index++;
+
+	// expression();
+	expression();
+
+	// if error, return
+	if(error == -1) {
+		return -1;
+	}
+
+	return relation;
+}
+
+// expression function, emits the code for the expression at the current 
+// 		token once all of it is parsed
+void expression() {
+
+	// root = parse_expression();
+	int root = parse_expression();
+
+	// if no error, emit it
+	if(error != -1)
+		emit_expression(root);
+
+	// the tree isn't needed anymore
+	expression_node_count = 0;
+}
+
+// parse_expression function, parses [+|-] term {(+|-) term} and returns 
+// 		the root of its tree, -1 on an error
+int parse_expression() {
+
+	int root;
+	int right;
+	int operation;
+
+	// if current token == plus || minus, it applies to the first term
+	operation = token_type_at(token_index) == minus ? SUB : ADD;
+	if(token_type_at(token_index) == plus || token_type_at(token_index) == minus){
+
+		// move to next token
+		token_index++;
+
+	}
+
+	// root = term();
+	root = term();
+
+	// if error, return
+	if(error == -1) {
+		return -1;
+	}
+
+	// a leading minus subtracts the term from 0, there is no NEG
+	if(operation == SUB)
+		root = expression_operation(SUB, expression_leaf(LIT, 0, -1), root);
+
+	// while current token == plus || minus
+	while(token_type_at(token_index) == plus || token_type_at(token_index) == minus){
+
+		operation = token_type_at(token_index) == plus ? ADD : SUB;
+
+		// move to next token
+		token_index++;
+
+		// right = term();
+		right = term();
+
+		// if error, return
+		if(error == -1) {
+			return -1;
+		}
+
+		root = expression_operation(operation, root, right);
+
+	}
+
+	return root;
+}
+
+// term function, parses factor {(*|/) factor} and returns the root of its 
+// 		tree, -1 on an error
+int term() {
+
+	int root;
+	int right;
+	int operation;
+
+	// root = factor();
+	root = factor();
+
+	// if error, return
+	if(error == -1) {
+		return -1;
+	}
+
+	// while current token == times || division
+	while(token_type_at(token_index) == times || token_type_at(token_index) == division){
+
+		operation = token_type_at(token_index) == times ? MUL : DIV;
+
+		// move to next token
+		token_index++;
+
+		// right = factor();
+		right = factor();
+
+		// if error, return
+		if(error == -1) {
+			return -1;
+		}
+
+		root = expression_operation(operation, root, right);
+
+	}
+
+	return root;
+}
+
+// the relation that holds exactly when relation doesn't
+int negate_relation(int relation)
+{
+	switch (relation)
+	{
+		case EQL : return NEQ;
+		case NEQ : return EQL;
+		case LSS : return GEQ;
+		case LEQ : return GTR;
+		case GTR : return LEQ;
+		default : return LSS;
+	}
+}
+
+// factor function, returns the expression node it parsed, -1 on an error
+int factor() {
+
+	int node;
+
+	//printf("start of factor\n");
+
+	// if current token == identifier
+	if(token_type_at(token_index) == identifier){
+
+		// constant_index = find_symbol(indentifier_name, 1);
+		int constant_index = find_symbol(token_name(token_index), 1);
+
+		// variable_index = find_symbol(indentifier_name, 2);
+		int variable_index = find_symbol(token_name(token_index), 2);
+
+		// if (constant_index == variable_index)
+		if(constant_index == variable_index) {
+
+			// this will only happen if there wasn’t a constant 
+			// AND there wasn’t a variable with the desired name
+
+			// if find_symbol(identifier_name, 3) != -1
+			if(find_symbol(token_name(token_index), 3) != -1){
+
+				// there is a valid procedure
+
+				// error 17, return
+				parser_error(17, 0);
+
+				// set error flag to -1
+				error = -1;
+
+				// return
+				return -1;
 
 			}
 
@@ -973,17 +2956,17 @@ void factor() {
 			else{
 
 				//printf("%d\n", token_index);
-				//printf("%s\n", tokens[token_index].identifier_name);
+				//printf("%s\n", token_name(token_index));
 				//printf("%s\n", table[5].name);
 
 				// error 8-4, return
-				print_parser_error(8, 4);
+				parser_error(8, 4);
 
 				// set error flag to -1
 				error = -1;
 
 				// return
-				return;
+				return -1;
 
 			}
 
@@ -992,32 +2975,32 @@ void factor() {
 		// if constant_index == -1
 		if(constant_index == -1) {
 
-			// emit LOD, L = level, M = address of variable from table
-			emit(LOD, level - table[variable_index].level, table[variable_index].address);
+			// node = LOD of the variable, lowering fills in L and M
+			node = expression_leaf(LOD, 0, variable_index);
 
 		}
 		
 		// else if var_index == -1
 		else if (variable_index == -1) {
 
-			// emit LIT , M = value of constant from table
-			emit(LIT, 0, table[constant_index].value);
+			// node = LIT, m = value of constant from table
+			node = expression_leaf(LIT, table[constant_index].value, -1);
 
 		}
 
 		// else if level of constant from table > level of variable from table
 		else if(table[constant_index].level > table[variable_index].level){
 
-			// emit LIT, m = value of constant from table
-			emit(LIT, 0, table[constant_index].value);
+			// node = LIT, m = value of constant from table
+			node = expression_leaf(LIT, table[constant_index].value, -1);
 
 		}
 
 		// else
 		else {
 
-			// emit LOD, L = level, M = address of variable from table
-			emit(LOD, level - table[variable_index].level, table[variable_index].address);
+			// node = LOD of the variable, lowering fills in L and M
+			node = expression_leaf(LOD, 0, variable_index);
 
 		} 
 
@@ -1027,10 +3010,43 @@ void factor() {
 	}
 	
 	// else if current token == number
-	else if(tokens[token_index].type == number){
+	else if(token_type_at(token_index) == number){
+
+		// node = LIT, m = number_value
+		node = expression_leaf(LIT, token_number(token_index), -1);
+
+		// move to next token
+		token_index++;
+
+	}
+
+	// else if current token == left_parenthesis
+	else if(token_type_at(token_index) == left_parenthesis){
+
+		// move to next token
+		token_index++;
+
+		// node = parse_expression();
+		node = parse_expression();
+
+		// if error, return
+		if(error == -1) {
+			return -1;
+		}
+
+		// if current token != right_parenthesis
+		if(token_type_at(token_index) != right_parenthesis){
+
+			// error 18, return
+			parser_error(18, 0);
 
-		// emit LIT, m = number_value
-		emit(LIT, 0, tokens[token_index].number_value);
+			// set error flag to -1
+			error = -1;
+
+			// return
+			return -1;
+
+		}
 
 		// move to next token
 		token_index++;
@@ -1041,319 +3057,2632 @@ void factor() {
 	else {
 
 		// error 19, return
-		print_parser_error(19, 0);
+		parser_error(19, 0);
 
 		// set error flag to -1
 		error = -1;
 
 		// return
-		return;
+		return -1;
 	}
 
 	//printf("end of factor\n");
 
+	return node;
+
 	// END OF FACTOR()
 }
 
-// adds a new instruction to the end of the code
-void emit(int op, int l, int m)
+// a LIT or LOD node
+int expression_leaf(int op, int m, int symbol)
 {
-	code[code_index].op = op;
-	code[code_index].l = l;
-	code[code_index].m = m;
-	code_index++;
-}
+	int node = add_expression_node(op, m, -1, -1);
 
-// adds a new symbol to the end of the table
-void add_symbol(int kind, char name[], int value, int level, int address)
-{
-	table[table_index].kind = kind;
-	strcpy(table[table_index].name, name);
-	table[table_index].value = value;
-	table[table_index].level = level;
-	table[table_index].address = address;
-	table[table_index].mark = 0;
-	table_index++;
+	expression_nodes[node].symbol = symbol;
+	return node;
 }
 
-// marks all of the current procedure's symbols
-void mark()
+// the node for left operation right. with -fexpressions an operation on two 
+// 		constants is folded, adding or subtracting 0 and multiplying or 
+// 		dividing by 1 go away, a constant operand of ADD or MUL moves to the 
+// 		right and is combined with a constant the left operand applies the 
+// 		same way, so 2 * x * 4 is x * 8. a LIT right before the MUL or DIV 
+// 		is what lets the JIT turn a power of two into a shift
+int expression_operation(int operation, int left, int right)
 {
-	int i;
-	for (i = table_index - 1; i >= 0; i--)
+	int value;
+	int swap;
+
+	if (!(optimizations & optimize_expressions))
+		return add_expression_node(OPR, operation, left, right);
+
+	if (expression_nodes[left].op == LIT && expression_nodes[right].op == LIT && 
+		fold_operation(operation, expression_nodes[left].m, expression_nodes[right].m, &value))
+		return expression_leaf(LIT, value, -1);
+	if ((operation == ADD || operation == MUL) && expression_nodes[left].op == LIT)
 	{
-		if (table[i].mark == 1)
-			continue;
-		if (table[i].level < level)
-			return;
-		table[i].mark = 1;
+		swap = left;
+		left = right;
+		right = swap;
 	}
+	if (((operation == ADD || operation == SUB) && constant_node(right, 0)) || 
+		((operation == MUL || operation == DIV) && constant_node(right, 1)))
+		return left;
+	// anything times 0 is 0, unless working it out would divide by 0
+	if (operation == MUL && constant_node(right, 0) && !expression_nodes[left].can_fail)
+		return right;
+	if ((operation == ADD || operation == MUL) && expression_nodes[right].op == LIT && 
+		expression_nodes[left].op == OPR && expression_nodes[left].m == operation && 
+		expression_nodes[expression_nodes[left].right].op == LIT && 
+		fold_operation(operation, expression_nodes[expression_nodes[left].right].m, 
+			expression_nodes[right].m, &value))
+		return expression_operation(operation, expression_nodes[left].left, expression_leaf(LIT, value, -1));
+	return add_expression_node(OPR, operation, left, right);
 }
 
-// returns -1 if there are no other symbols with the same name within this procedure
-int multiple_declaration_check(char name[])
+// appends a node, working out its depth. the operands of ADD and MUL can 
+// 		go in either order, with -fexpressions emit_expression() puts the 
+// 		deeper one first (Sethi-Ullman), otherwise the right operand's 
+// 		code runs with the left one's value under it
+int add_expression_node(int op, int m, int left, int right)
 {
-	int i;
-	for (i = 0; i < table_index; i++)
-		if (table[i].mark == 0 && table[i].level == level && strcmp(name, table[i].name) == 0)
-			return i;
-	return -1;
+	expression_node *node;
+	int left_depth;
+	int right_depth;
+
+	expression_nodes = grow_array(expression_nodes, &expression_node_capacity, 
+		expression_node_count + 1, sizeof(expression_node));
+	node = &expression_nodes[expression_node_count];
+	node->op = op;
+	node->m = m;
+	node->symbol = -1;
+	node->left = left;
+	node->right = right;
+	node->depth = 1;
+	node->can_fail = false;
+	if (op == OPR)
+	{
+		left_depth = expression_nodes[left].depth;
+		right_depth = expression_nodes[right].depth;
+		if ((optimizations & optimize_expressions) && (m == ADD || m == MUL))
+			node->depth = left_depth == right_depth ? left_depth + 1 : 
+				left_depth > right_depth ? left_depth : right_depth;
+		else
+			node->depth = left_depth > right_depth + 1 ? left_depth : right_depth + 1;
+		node->can_fail = expression_nodes[left].can_fail || expression_nodes[right].can_fail || 
+			(m == DIV && !(expression_nodes[right].op == LIT && expression_nodes[right].m != 0 && 
+			expression_nodes[right].m != -1));
+	}
+	return expression_node_count++;
 }
 
-// returns the index of the symbol with the desired name and kind, prioritizing 
-// 		symbols with level closer to the current level
-int find_symbol(char name[], int kind)
+// a op b the way the VM works it out, false for a division by 0 or one 
+// 		that overflows, which is left to fail at run time
+bool fold_operation(int operation, int a, int b, int *result)
 {
-	int i;
-	int max_idx = -1;
-	int max_lvl = -1;
-	for (i = 0; i < table_index; i++)
+	switch (operation)
 	{
-		if (table[i].mark == 0 && table[i].kind == kind && strcmp(name, table[i].name) == 0)
-		{
-			if (max_idx == -1 || table[i].level > max_lvl)
-			{
-				max_idx = i;
-				max_lvl = table[i].level;
-			}
-		}
+		case ADD :
+			*result = (int) ((unsigned) a + (unsigned) b);
+			return true;
+		case SUB :
+			*result = (int) ((unsigned) a - (unsigned) b);
+			return true;
+		case MUL :
+			*result = (int) ((unsigned) a * (unsigned) b);
+			return true;
+		case DIV :
+			if (b == 0 || (a == INT_MIN && b == -1))
+				return false;
+			*result = a / b;
+			return true;
+		default :
+			return false;
 	}
-	return max_idx;
 }
 
-void print_parser_error(int error_code, int case_code)
+// whether node is a LIT of value
+bool constant_node(int node, int value)
 {
-	switch (error_code)
-	{
+	return expression_nodes[node].op == LIT && expression_nodes[node].m == value;
+}
+
+// emits a tree's code, operands before the operation
+void emit_expression(int node)
+{
+	expression_node *expression = &expression_nodes[node];
+
+	if (expression->op == LIT)
+		emit(LIT, 0, expression->m);
+	else if (expression->op == LOD)
+		emit_variable_access(LOD, expression->symbol);
+	else
+	{
+		if ((optimizations & optimize_expressions) && (expression->m == ADD || expression->m == MUL) && 
+			expression_nodes[expression->right].depth > expression_nodes[expression->left].depth)
+		{
+			emit_expression(expression->right);
+			emit_expression(expression->left);
+		}
+		else
+		{
+			emit_expression(expression->left);
+			emit_expression(expression->right);
+		}
+		emit(OPR, 0, expression->m);
+	}
+}
+
+// adds a new instruction to the end of the current procedure
+void emit(int op, int l, int m)
+{
+	ir_add_node(op, l, m, -1);
+}
+
+// emits a LOD or STO of a variable, its level and address get filled in 
+// 		by lower_procedure()
+void emit_variable_access(int op, int symbol_index)
+{
+	ir_add_node(op, 0, 0, symbol_index);
+}
+
+// emits a CAL of a procedure, its address gets filled in by lower_procedure()
+void emit_call(int symbol_index)
+{
+	ir_add_node(CAL, 0, 0, symbol_index);
+}
+
+// starts the code for a procedure at the current level with an empty block. 
+// 		the procedure before it is finished now, so this one's address is 
+// 		known and procedures that were waiting on it can be lowered
+void ir_begin_procedure(int symbol_index, int source)
+{
+	// the JMP to main goes in front of everything
+	if (ir_procedure_count == 0)
+		emit_instruction(JMP, 0, 0, -1);
+	else
+		ir_finish_procedure(&ir_procedures[ir_procedure_count - 1]);
+	table[symbol_index].address = ir_next_address * 3;
+	if (symbol_index == 0)
+		code[0].m = table[0].address;
+
+	ir_procedures = grow_array(ir_procedures, &ir_procedure_capacity, ir_procedure_count + 1, sizeof(ir_procedure));
+	ir_procedures[ir_procedure_count].symbol = symbol_index;
+	ir_procedures[ir_procedure_count].level = level;
+	ir_procedures[ir_procedure_count].first_block = ir_block_count;
+	ir_procedures[ir_procedure_count].block_count = 0;
+	ir_procedures[ir_procedure_count].source = source;
+	ir_procedure_count++;
+	ir_new_block();
+	lower_finished_procedures(ir_procedure_count - 1);
+}
+
+// starts a new block in the current procedure and returns its id, the 
+// 		previous block falls through into it unless it ended in a jump
+int ir_new_block()
+{
+	int previous = ir_block_count - 1;
+	ir_node *last;
+
+	// a procedure's first block has nothing falling into it
+	if (previous >= ir_procedures[ir_procedure_count - 1].first_block)
+	{
+		last = ir_blocks[previous].node_count > 0 ? 
+			&ir_nodes[ir_blocks[previous].first_node + ir_blocks[previous].node_count - 1] : NULL;
+		if (last == NULL || (last->op != JMP && !(last->op == OPR && last->m == RTN) && 
+			!(last->op == SYS && last->m == HLT)))
+			ir_blocks[previous].fallthrough = ir_block_count;
+	}
+
+	ir_blocks = grow_array(ir_blocks, &ir_block_capacity, ir_block_count + 1, sizeof(ir_block));
+	ir_blocks[ir_block_count].first_node = ir_node_count;
+	ir_blocks[ir_block_count].node_count = 0;
+	ir_blocks[ir_block_count].fallthrough = -1;
+	ir_blocks[ir_block_count].branch = -1;
+	ir_blocks[ir_block_count].address = 0;
+	ir_procedures[ir_procedure_count - 1].block_count++;
+	return ir_block_count++;
+}
+
+// appends a node to the current block, a JMP or JPC's m is a block id
+void ir_add_node(int op, int l, int m, int symbol)
+{
+	ir_nodes = grow_array(ir_nodes, &ir_node_capacity, ir_node_count + 1, sizeof(ir_node));
+	ir_nodes[ir_node_count].op = op;
+	ir_nodes[ir_node_count].l = l;
+	ir_nodes[ir_node_count].m = m;
+	ir_nodes[ir_node_count].symbol = symbol;
+	ir_nodes[ir_node_count].source = current_source;
+	ir_node_count++;
+	ir_blocks[ir_block_count - 1].node_count++;
+	if (op == JMP || op == JPC)
+		ir_blocks[ir_block_count - 1].branch = m;
+}
+
+// the block the next node goes in as a jump target, the current block if 
+// 		nothing is in it yet
+int ir_label()
+{
+	if (ir_blocks[ir_block_count - 1].node_count == 0)
+		return ir_block_count - 1;
+	return ir_new_block();
+}
+
+// appends copies of nodes first up to end to the current block, they can't 
+// 		include a jump since its block id would still be the original's
+void ir_copy_nodes(int first, int end)
+{
+	ir_node node;
+
+	for (; first < end; first++)
+	{
+		// ir_add_node() can move ir_nodes, so copy out of it first
+		node = ir_nodes[first];
+		ir_add_node(node.op, node.l, node.m, node.symbol);
+		ir_nodes[ir_node_count - 1].source = node.source;
+	}
+}
+
+// ends the current block with a JMP or JPC whose target isn't known yet and 
+// 		starts the next one. jumps waiting on the same target are chained 
+// 		through their m, list is the chain to add to (-1 for a new one) and 
+// 		the block returned heads the longer chain
+int ir_jump(int op, int list)
+{
+	int block = ir_block_count - 1;
+
+	ir_add_node(op, 0, list, -1);
+	ir_new_block();
+	return block;
+}
+
+// points every jump on a chain ir_jump() built at target
+void ir_patch_jumps(int list, int target)
+{
+	ir_node *jump;
+
+	while (list != -1)
+	{
+		jump = &ir_nodes[ir_blocks[list].first_node + ir_blocks[list].node_count - 1];
+		ir_blocks[list].branch = target;
+		list = jump->m;
+		jump->m = target;
+	}
+}
+
+// emits relation's OPR and a JPC taken when it's false, returns the chain 
+// 		with the JPC added
+int emit_branch(int relation, int list)
+{
+	emit(OPR, 0, relation);
+	return ir_jump(JPC, list);
+}
+
+// gives a finished procedure's blocks their addresses, the next procedure 
+// 		starts right after its last one
+void ir_finish_procedure(ir_procedure *procedure)
+{
+	int address = table[procedure->symbol].address / 3;
+	int b;
+
+	for (b = procedure->first_block; b < procedure->first_block + procedure->block_count; b++)
+	{
+		ir_blocks[b].address = address;
+		address += ir_blocks[b].node_count;
+	}
+	ir_next_address = address;
+}
+
+// finishes main, the last procedure, and lowers everything still waiting
+void ir_finish_program()
+{
+	ir_finish_procedure(&ir_procedures[ir_procedure_count - 1]);
+	lower_finished_procedures(ir_procedure_count);
+}
+
+// lowers the first finished procedures in order for as long as the next 
+// 		one's calls all resolve. a call to an enclosing procedure holds it 
+// 		back until that procedure's own code starts
+void lower_finished_procedures(int finished)
+{
+	while (ir_lowered_count < finished && calls_resolved(&ir_procedures[ir_lowered_count]))
+		lower_procedure(&ir_procedures[ir_lowered_count++]);
+}
+
+// every procedure gets an address when its code starts, until then it has 
+// 		the 0 add_symbol() gave it, which is the JMP to main's
+bool calls_resolved(ir_procedure *procedure)
+{
+	ir_node *node;
+	int b;
+
+	for (b = procedure->first_block; b < procedure->first_block + procedure->block_count; b++)
+		for (node = &ir_nodes[ir_blocks[b].first_node]; 
+			node < &ir_nodes[ir_blocks[b].first_node + ir_blocks[b].node_count]; node++)
+			if (node->op == CAL && table[node->symbol].address == 0)
+				return false;
+	return true;
+}
+
+// writes a procedure's PAS code, which always goes right after the code 
+// 		lowered before it, and hands it to the pipeline's writer if one is 
+// 		listening
+void lower_procedure(ir_procedure *procedure)
+{
+	int first = code_index;
+	int b;
+	int n;
+
+	trace_begin("lower", procedure->symbol, procedure->level);
+	for (b = procedure->first_block; b < procedure->first_block + procedure->block_count; b++)
+		for (n = ir_blocks[b].first_node; n < ir_blocks[b].first_node + ir_blocks[b].node_count; n++)
+			lower_node(procedure, &ir_nodes[n]);
+	trace_end("lower");
+	if (code_sink != NULL)
+		stage_queue_send(code_sink, &code[first], code_index - first);
+}
+
+// writes one node as an instruction. non-local accesses to main's variables 
+// 		become LDG or STG when global addressing is on, and nodes emitted 
+// 		outside any statement are charged to the procedure's block
+void lower_node(ir_procedure *procedure, ir_node *node)
+{
+	int distance = node->symbol != -1 ? procedure->level - table[node->symbol].level : 0;
+	int source = node->source != -1 ? node->source : procedure->source;
+
+	if (node->op == CAL)
+		emit_instruction(CAL, distance, table[node->symbol].address, source);
+	else if ((node->op == LOD || node->op == STO) && node->symbol != -1)
+	{
+		if ((optimizations & optimize_global_addressing) && distance > 0 && table[node->symbol].level == 0)
+			emit_instruction(node->op == LOD ? LDG : STG, 0, table[node->symbol].address, source);
+		else
+			emit_instruction(node->op, distance, table[node->symbol].address, source);
+	}
+	else if (node->op == JMP || node->op == JPC)
+		emit_instruction(node->op, 0, ir_blocks[node->m].address * 3, source);
+	else
+		emit_instruction(node->op, node->l, node->m, source);
+}
+
+// adds a new instruction to the end of the code
+void emit_instruction(int op, int l, int m, int source)
+{
+	code = grow_array(code, &code_capacity, code_index + 1, sizeof(instruction));
+	code_sources = grow_array(code_sources, &code_source_capacity, code_index + 1, sizeof(int));
+	code[code_index].op = op;
+	code[code_index].l = l;
+	code[code_index].m = m;
+	code_sources[code_index] = source;
+	code_index++;
+}
+
+// starts a source range at the current token for a statement, or with 
+// 		block for the block of procedure_index, and returns its index. its 
+// 		last token is filled in once it has been parsed
+int add_source(int procedure_index, bool block)
+{
+	sources = grow_array(sources, &source_capacity, source_count + 1, sizeof(source_range));
+	sources[source_count].first_token = token_index;
+	sources[source_count].last_token = token_index;
+	sources[source_count].procedure = procedure_index;
+	sources[source_count].block = block;
+	return source_count++;
+}
+
+// turns code_sources into the source map, one span per run of 
+// 		instructions from the same source
+void build_source_map()
+{
+	int i;
+
+	source_map = compile_allocate((code_index + 1) * sizeof(source_span));
+	source_map_length = 0;
+	for (i = 0; i < code_index; i++)
+	{
+		if (code_sources[i] == -1 || (i > 0 && code_sources[i] == code_sources[i - 1]))
+			continue;
+		source_map[source_map_length].first_instruction = i;
+		source_map[source_map_length].first_token = sources[code_sources[i]].first_token;
+		source_map[source_map_length].last_token = sources[code_sources[i]].last_token;
+		source_map[source_map_length].procedure = sources[code_sources[i]].procedure;
+		source_map_length++;
+	}
+}
+
+// prints a source range as its tokens, a block as the procedure it belongs 
+// 		to since its tokens are the whole body
+void print_source_text(FILE *ofp, int source)
+{
+	int i;
+
+	if (source == -1)
+	{
+		fprintf(ofp, "-");
+		return;
+	}
+	if (sources[source].block)
+	{
+		fprintf(ofp, "(%s entry and exit)", table[sources[source].procedure].name);
+		return;
+	}
+	for (i = sources[source].first_token; i <= sources[source].last_token; i++)
+	{
+		if (i - sources[source].first_token == SOURCE_TEXT_TOKENS)
+		{
+			fprintf(ofp, " ...");
+			break;
+		}
+		if (i > sources[source].first_token)
+			fprintf(ofp, " ");
+		if (token_type_at(i) == identifier)
+			fprintf(ofp, "%s", token_name(i));
+		else if (token_type_at(i) == number)
+			fprintf(ofp, "%d", token_number(i));
+		else
+			fprintf(ofp, "%s", token_spelling[token_type_at(i)]);
+	}
+}
+
+// checks every lexeme the parser will read and finds the structure it 
+// 		would otherwise only learn while descending: brace and begin/end 
+// 		balance and where each procedure's tokens start and end. lexemes 
+// 		go VALIDATE_LANES at a time through vector range checks that also 
+// 		flag the few structural tokens, then only those get walked one by 
+// 		one. the procedure list lives in the compile arena. returns false if 
+// 		some lexeme is invalid. the parser only acts on the invalid lexeme, 
+// 		the balances and procedures are reported for the caller
+bool validate_lexemes(const lexeme *input, int count, lexeme_summary *summary)
+{
+	uint32_t identifier_limit = atomic_load_explicit(&intern_count, memory_order_acquire);
+	int *open = NULL;
+	int open_count = 0;
+	int open_capacity = 0;
+	int procedure_capacity = 0;
+	int pending = -1;
+	unsigned structure;
+	int i = 0;
+	int k;
+
+	summary->invalid_lexeme = -1;
+	summary->brace_balance = 0;
+	summary->begin_balance = 0;
+	summary->ends_with_period = count > 0 && input[count - 1].type == period;
+	summary->procedures = NULL;
+	summary->procedure_count = 0;
+
+#ifdef VALIDATE_VECTORS
+	for (; i + VALIDATE_LANES <= count && sizeof(lexeme) == sizeof(uint64_t); i += VALIDATE_LANES)
+	{
+		lexeme_vector words;
+		lexeme_vector type;
+		lexeme_vector payload;
+		lexeme_vector bad;
+		lexeme_vector structural;
+
+		memcpy(&words, &input[i], sizeof(words));
+		type = words & 0xff;
+		payload = words >> 32;
+
+		// unsigned, so a type of 0 wraps around and fails as well
+		bad = (lexeme_vector) (type - 1 > right_parenthesis - 1) | 
+			((lexeme_vector) (type == identifier) & (lexeme_vector) (payload >= identifier_limit)) | 
+			((lexeme_vector) (type == number) & (lexeme_vector) (payload >= (uint64_t) number_count));
+		structural = (lexeme_vector) (type == keyword_procedure) | (lexeme_vector) (type == left_curly_brace) | 
+			(lexeme_vector) (type == right_curly_brace) | (lexeme_vector) (type == keyword_begin) | 
+			(lexeme_vector) (type == keyword_end);
+
+		structure = 0;
+		for (k = 0; k < VALIDATE_LANES; k++)
+		{
+			if (bad[k] != 0)
+				break;
+			structure |= (unsigned) (structural[k] & 1) << k;
+		}
+		if (k < VALIDATE_LANES)
+			break;
+		while (structure != 0)
+		{
+			k = __builtin_ctz(structure);
+			structure &= structure - 1;
+			note_structure(summary, i + k, input[i + k].type, &open, &open_count, &open_capacity, 
+				&procedure_capacity, &pending);
+		}
+	}
+#endif
+
+	// the lexemes that didn't fill a vector, and the one that failed if any
+	for (; i < count; i++)
+	{
+		if (!valid_lexeme(&input[i], identifier_limit))
+		{
+			summary->invalid_lexeme = i;
+			return false;
+		}
+		if (structural_token(input[i].type))
+			note_structure(summary, i, input[i].type, &open, &open_count, &open_capacity, 
+				&procedure_capacity, &pending);
+	}
+	return true;
+}
+
+bool valid_lexeme(const lexeme *entry, uint32_t identifier_limit)
+{
+	if (entry->type == 0 || entry->type > right_parenthesis)
+		return false;
+	if (entry->type == identifier)
+		return entry->payload < identifier_limit;
+	if (entry->type == number)
+		return entry->payload < (uint32_t) number_count;
+	return true;
+}
+
+bool structural_token(int type)
+{
+	return type == keyword_procedure || type == left_curly_brace || type == right_curly_brace || 
+		type == keyword_begin || type == keyword_end;
+}
+
+// keeps the balances and the procedure list up to date for one structural 
+// 		token. a procedure starts at its keyword and is the one the next { 
+// 		opens, open holds the procedure each unclosed { belongs to
+void note_structure(lexeme_summary *summary, int index, int type, int **open, int *open_count, 
+	int *open_capacity, int *procedure_capacity, int *pending)
+{
+	int procedure;
+
+	switch (type)
+	{
+		case keyword_procedure :
+			summary->procedures = grow_array(summary->procedures, procedure_capacity, 
+				summary->procedure_count + 1, sizeof(token_range));
+			summary->procedures[summary->procedure_count].first_token = index;
+			summary->procedures[summary->procedure_count].last_token = -1;
+			*pending = summary->procedure_count++;
+			break;
+		case left_curly_brace :
+			*open = grow_array(*open, open_capacity, *open_count + 1, sizeof(int));
+			(*open)[(*open_count)++] = *pending;
+			*pending = -1;
+			summary->brace_balance++;
+			break;
+		case right_curly_brace :
+			if (*open_count > 0)
+			{
+				procedure = (*open)[--(*open_count)];
+				if (procedure != -1)
+					summary->procedures[procedure].last_token = index;
+			}
+			summary->brace_balance--;
+			break;
+		case keyword_begin :
+			summary->begin_balance++;
+			break;
+		case keyword_end :
+			summary->begin_balance--;
+			break;
+	}
+}
+
+// reads the numeric token text produced by the standalone lexer
+int read_token_text(const char *text, int length)
+{
+	const char *end = text + length;
+	char name_buffer[IDENTIFIER_LENGTH];
+	int buffer;
+	int i;
+
+	while (read_token_int(&text, end, &buffer))
+	{
+		if (buffer == identifier)
+		{
+			// identifiers are whitespace delimited words, longer ones get truncated
+			while (text < end && isspace((unsigned char) *text))
+				text++;
+			for (i = 0; text < end && !isspace((unsigned char) *text); text++)
+				if (i < IDENTIFIER_LENGTH - 1)
+					name_buffer[i++] = *text;
+			name_buffer[i] = '\0';
+			add_token(buffer, intern_identifier(name_buffer));
+		}
+		else if (buffer == number)
+		{
+			int value = 0;
+			if (!read_token_int(&text, end, &value))
+				break;
+			add_number_token(value);
+		}
+		else if (buffer > 0 && buffer <= right_parenthesis)
+			add_token(buffer, 0);
+		else
+			break;
+	}
+
+	// anything left is a token or number that isn't one or doesn't fit
+	while (text < end && isspace((unsigned char) *text))
+		text++;
+	if (text < end)
+	{
+		token_index = token_count;
+		lexer_error(6);
+		return -1;
+	}
+	return 0;
+}
+
+// reads one optionally signed integer without running past end, returns false 
+// 		when there isn't one or it doesn't fit in an int
+bool read_token_int(const char **text, const char *end, int *value)
+{
+	const char *position = *text;
+	bool negative = false;
+	unsigned limit = INT_MAX;
+	unsigned magnitude = 0;
+	unsigned digit;
+
+	while (position < end && isspace((unsigned char) *position))
+		position++;
+	if (position < end && *position == '-')
+	{
+		// INT_MIN has one more to it than INT_MAX
+		negative = true;
+		limit = (unsigned) INT_MAX + 1;
+		position++;
+	}
+	if (position == end || !isdigit((unsigned char) *position))
+		return false;
+	while (position < end && isdigit((unsigned char) *position))
+	{
+		digit = *position++ - '0';
+		if (magnitude > (limit - digit) / 10)
+			return false;
+		magnitude = magnitude * 10 + digit;
+	}
+
+	*value = negative && magnitude > 0 ? -(int) (magnitude - 1) - 1 : (int) magnitude;
+	*text = position;
+	return true;
+}
+
+// turns PL/0 source straight into tokens, returns -1 on a lexical error
+int lex_source(const char *source, int length)
+{
+	int position = 0;
+
+	while (position < length)
+	{
+		int start = position;
+		int state = LS_START;
+		int next;
+
+		if (char_class[(unsigned char) source[position]] == LC_SPACE)
+		{
+			position++;
+			continue;
+		}
+
+		// run the dfa for the longest match
+		while (position < length && 
+			(next = lexer_table[state][char_class[(unsigned char) source[position]]]) != LS_NONE)
+		{
+			state = next;
+			position++;
+		}
+
+		switch (state)
+		{
+			case LS_COMMENT_END :
+				break;
+			case LS_COMMENT :
+			case LS_COMMENT_STAR :
+				lexer_error(4);
+				return -1;
+			case LS_IDENTIFIER :
+			{
+				char name[IDENTIFIER_LENGTH];
+				token_type keyword;
+				if (position - start >= IDENTIFIER_LENGTH)
+				{
+					lexer_error(1);
+					return -1;
+				}
+				keyword = keyword_lookup(source + start, position - start);
+				if (keyword != 0)
+				{
+					add_token(keyword, 0);
+					break;
+				}
+				memcpy(name, source + start, position - start);
+				name[position - start] = '\0';
+				add_token(identifier, intern_identifier(name));
+				break;
+			}
+			case LS_NUMBER :
+			{
+				int value = 0;
+				int i;
+				if (position - start > 5)
+				{
+					lexer_error(2);
+					return -1;
+				}
+				if (position < length && char_class[(unsigned char) source[position]] == LC_LETTER)
+				{
+					lexer_error(5);
+					return -1;
+				}
+				for (i = start; i < position; i++)
+					value = value * 10 + (source[i] - '0');
+				add_number_token(value);
+				break;
+			}
+			case LS_SINGLE :
+				switch (source[start])
+				{
+					case '.' : add_token(period, 0); break;
+					case '-' : add_token(minus, 0); break;
+					case ';' : add_token(semicolon, 0); break;
+					case '{' : add_token(left_curly_brace, 0); break;
+					case '}' : add_token(right_curly_brace, 0); break;
+					case '=' : add_token(equal_to, 0); break;
+					case '+' : add_token(plus, 0); break;
+					case '*' : add_token(times, 0); break;
+					case '(' : add_token(left_parenthesis, 0); break;
+					case ')' : add_token(right_parenthesis, 0); break;
+				}
+				break;
+			default :
+				if (lexer_accept[state] == 0)
+				{
+					lexer_error(3);
+					return -1;
+				}
+				add_token(lexer_accept[state], 0);
+		}
+	}
+
+	return 0;
+}
+
+// returns the keyword token for word, or 0 if it is an identifier
+token_type keyword_lookup(const char *word, int length)
+{
+	const keyword_entry *entry;
+	if (length < 2 || length > 9)
+		return 0;
+	entry = &keyword_table[((unsigned char) word[0] + 10 * (unsigned char) word[1] + 13 * length) % 18];
+	if (entry->name != NULL && strlen(entry->name) == (size_t) length && 
+		strncmp(entry->name, word, length) == 0)
+		return entry->type;
+	return 0;
+}
+
+// hands out size bytes from the arena, only mallocing when no retained block 
+// 		has room left
+void *arena_allocate(arena *pool, size_t size)
+{
+	void *allocation;
+	size = (size + 15) & ~(size_t) 15;
+
+	if (pool->current == NULL || pool->used + size > pool->current->capacity)
+	{
+		arena_block *next = pool->current == NULL ? pool->first : pool->current->next;
+
+		// move on to the next retained block, or chain in a new one after this one
+		if (next == NULL || next->capacity < size)
+		{
+			size_t capacity = pool->current == NULL ? 64 * 1024 : pool->current->capacity * 2;
+			arena_block *block;
+			while (capacity < size)
+				capacity *= 2;
+			block = malloc(sizeof(arena_block) + capacity);
+			if (block == NULL)
+				return NULL;
+			block->capacity = capacity;
+			block->next = next;
+			if (pool->current == NULL)
+				pool->first = block;
+			else
+				pool->current->next = block;
+			next = block;
+			pool->stats.malloc_calls++;
+			pool->stats.bytes_reserved += capacity;
+		}
+		if (pool->current != NULL)
+			pool->used_before_current += pool->used;
+		pool->current = next;
+		pool->used = 0;
+	}
+
+	allocation = pool->current->data + pool->used;
+	pool->used += size;
+	pool->last_allocation = allocation;
+	pool->stats.allocations++;
+	if ((long) (pool->used_before_current + pool->used) > pool->stats.high_water)
+		pool->stats.high_water = pool->used_before_current + pool->used;
+	return allocation;
+}
+
+// grows an allocation, in place when it was the last one handed out
+void *arena_resize(arena *pool, void *allocation, size_t old_size, size_t new_size)
+{
+	void *moved;
+	old_size = (old_size + 15) & ~(size_t) 15;
+
+	if (allocation != NULL && allocation == pool->last_allocation && 
+		(char *) allocation - pool->current->data + new_size <= pool->current->capacity)
+	{
+		pool->used = (char *) allocation - pool->current->data + ((new_size + 15) & ~(size_t) 15);
+		if ((long) (pool->used_before_current + pool->used) > pool->stats.high_water)
+			pool->stats.high_water = pool->used_before_current + pool->used;
+		return allocation;
+	}
+
+	moved = arena_allocate(pool, new_size);
+	if (moved == NULL)
+		return NULL;
+	if (allocation != NULL)
+		memcpy(moved, allocation, old_size < new_size ? old_size : new_size);
+	return moved;
+}
+
+// forgets every allocation at once, the blocks are kept for reuse
+void arena_reset(arena *pool)
+{
+	pool->current = NULL;
+	pool->used = 0;
+	pool->used_before_current = 0;
+	pool->last_allocation = NULL;
+	pool->stats.resets++;
+}
+
+// gives the blocks back to malloc
+void arena_release(arena *pool)
+{
+	arena_block *block = pool->first;
+	while (block != NULL)
+	{
+		arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+	pool->first = NULL;
+	pool->current = NULL;
+	pool->used = 0;
+	pool->used_before_current = 0;
+	pool->last_allocation = NULL;
+	pool->stats.bytes_reserved = 0;
+}
+
+// capacity has to be a power of two
+bool stage_queue_init(stage_queue *queue, uint32_t capacity, size_t element_size)
+{
+	queue->slots = malloc(capacity * element_size);
+	queue->element_size = element_size;
+	queue->capacity = capacity;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	atomic_init(&queue->closed, false);
+	return queue->slots != NULL;
+}
+
+void stage_queue_destroy(stage_queue *queue)
+{
+	free(queue->slots);
+	queue->slots = NULL;
+}
+
+// producer side, waits while the ring is full
+void stage_queue_send(stage_queue *queue, const void *elements, int count)
+{
+	const char *from = elements;
+	uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	uint32_t room;
+	uint32_t i;
+	int spins = 0;
+
+	while (count > 0)
+	{
+		room = queue->capacity - (tail - atomic_load_explicit(&queue->head, memory_order_acquire));
+		if (room == 0)
+		{
+			stage_wait(&spins);
+			continue;
+		}
+		spins = 0;
+		if (room > (uint32_t) count)
+			room = count;
+		for (i = 0; i < room; i++, from += queue->element_size)
+			memcpy(queue->slots + ((tail + i) & (queue->capacity - 1)) * queue->element_size, from, 
+				queue->element_size);
+		tail += room;
+		count -= room;
+		atomic_store_explicit(&queue->tail, tail, memory_order_release);
+	}
+}
+
+// consumer side, waits for at least one element and takes up to limit of 
+// 		them. returns 0 once the queue is closed and drained
+int stage_queue_receive(stage_queue *queue, void *elements, int limit)
+{
+	char *to = elements;
+	uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	uint32_t tail;
+	uint32_t count;
+	uint32_t i;
+	int spins = 0;
+
+	while ((tail = atomic_load_explicit(&queue->tail, memory_order_acquire)) == head)
+	{
+		// close comes after the last send, so check the tail once more
+		if (atomic_load_explicit(&queue->closed, memory_order_acquire))
+		{
+			tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+			if (tail == head)
+				return 0;
+			break;
+		}
+		stage_wait(&spins);
+	}
+
+	count = tail - head < (uint32_t) limit ? tail - head : (uint32_t) limit;
+	for (i = 0; i < count; i++, to += queue->element_size)
+		memcpy(to, queue->slots + ((head + i) & (queue->capacity - 1)) * queue->element_size, 
+			queue->element_size);
+	atomic_store_explicit(&queue->head, head + count, memory_order_release);
+	return count;
+}
+
+void stage_queue_close(stage_queue *queue)
+{
+	atomic_store_explicit(&queue->closed, true, memory_order_release);
+}
+
+// spins for a little while, then starts giving the cpu away
+void stage_wait(int *spins)
+{
+	if (++*spins > 64)
+		sched_yield();
+}
+
+// grows an arena array to hold at least minimum elements, doubling from 
+// 		ARRAY_SIZE like the original fixed size tables
+void *grow_array(void *array, int *capacity, int minimum, size_t element_size)
+{
+	int new_capacity = *capacity == 0 ? ARRAY_SIZE : *capacity;
+	if (minimum <= *capacity)
+		return array;
+	while (new_capacity < minimum)
+		new_capacity *= 2;
+	array = arena_resize(&compile_arena, array, *capacity * element_size, new_capacity * element_size);
+	if (array == NULL)
+		out_of_memory();
+	*capacity = new_capacity;
+	return array;
+}
+
+// arena_allocate() from this thread's compile arena, which never returns NULL
+void *compile_allocate(size_t size)
+{
+	void *allocation = arena_allocate(&compile_arena, size);
+
+	if (allocation == NULL)
+		out_of_memory();
+	return allocation;
+}
+
+// abandons a compilation whose arena couldn't grow, it ends with an out of 
+// 		memory error instead. anything else has no way to go on
+void out_of_memory()
+{
+	if (allocation_recovery != NULL)
+		longjmp(*allocation_recovery, 1);
+	fprintf(stderr, "%s\n", parser_error_message(20, 0));
+	exit(1);
+}
+
+// makes room for count more tokens plus the zeroed sentinel the parser can 
+// 		safely look at one past the end of the input
+void reserve_tokens(int count)
+{
+	tokens = grow_array(tokens, &token_capacity, token_count + count + 1, sizeof(lexeme));
+	tokens[token_count].type = 0;
+	tokens[token_count].payload = 0;
+}
+
+// appends a token, keeping the sentinel after it
+void add_token(int type, uint32_t payload)
+{
+	if (token_sink != NULL)
+	{
+		sink_batch[sink_batch_count].type = type;
+		sink_batch[sink_batch_count].payload = payload;
+		if (++sink_batch_count == STAGE_BATCH)
+			flush_token_sink();
+		return;
+	}
+	reserve_tokens(1);
+	tokens[token_count].type = type;
+	tokens[token_count].payload = payload;
+	token_count++;
+	tokens[token_count].type = 0;
+	tokens[token_count].payload = 0;
+}
+
+// number pools belong to the thread that parses, so a lexer stage sends the 
+// 		value along and the parser pools it when the token arrives
+void add_number_token(int value)
+{
+	if (token_sink != NULL)
+		add_token(number, (uint32_t) value);
+	else
+		add_token(number, pool_number(value));
+}
+
+void flush_token_sink()
+{
+	stage_queue_send(token_sink, sink_batch, sink_batch_count);
+	sink_batch_count = 0;
+}
+
+// takes lexemes from the lexer stage until token index has arrived or the 
+// 		input has ended, in which case the parser sees the end sentinel
+void receive_tokens(int index)
+{
+	lexeme batch[STAGE_BATCH];
+	int count;
+	int i;
+
+	while (index >= token_count && (count = stage_queue_receive(token_source, batch, STAGE_BATCH)) > 0)
+		for (i = 0; i < count; i++)
+			add_token(batch[i].type, batch[i].type == number ? pool_number((int) batch[i].payload) 
+				: batch[i].payload);
+}
+
+// FNV-1a hash of an identifier
+uint32_t hash_identifier(char name[])
+{
+	int i;
+	uint32_t hash = 2166136261u;
+	for (i = 0; name[i] != '\0'; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	return hash;
+}
+
+// returns the id of name in the shared identifier table, adding it if it is 
+// 		new. two threads adding the same name race for the same empty slot, 
+// 		the loser returns the winner's id and its own id goes unused
+uint32_t intern_identifier(char name[])
+{
+	_Atomic(intern_level *) *link = &intern_levels;
+	uint32_t hash = hash_identifier(name);
+	uint32_t slot_count = INTERN_FIRST_LEVEL;
+	uint64_t claimed = 0;
+	uint64_t slot;
+	intern_level *level_table;
+	uint32_t i;
+	int probe;
+
+	while (1)
+	{
+		level_table = intern_level_at(link, slot_count);
+		i = hash & level_table->mask;
+		for (probe = 0; probe < INTERN_PROBES; probe++, i = (i + 1) & level_table->mask)
+		{
+			slot = atomic_load_explicit(&level_table->slots[i], memory_order_acquire);
+			if (slot == 0)
+			{
+				// the name has to be readable before its slot is
+				if (claimed == 0)
+					claimed = (uint64_t) hash << 32 | (store_identifier(name) + 1);
+				if (atomic_compare_exchange_strong_explicit(&level_table->slots[i], &slot, claimed, 
+					memory_order_release, memory_order_acquire))
+					return (uint32_t) claimed - 1;
+				// slot now holds what the other thread put there
+			}
+			if ((uint32_t) (slot >> 32) == hash && strcmp(identifier_name((uint32_t) slot - 1), name) == 0)
+				return (uint32_t) slot - 1;
+		}
+		link = &level_table->next;
+		slot_count *= 2;
+	}
+}
+
+// the level *link points to, adding an empty one of slot_count slots if 
+// 		there isn't one yet
+intern_level *intern_level_at(_Atomic(intern_level *) *link, uint32_t slot_count)
+{
+	intern_level *expected = NULL;
+	intern_level *added = atomic_load_explicit(link, memory_order_acquire);
+
+	if (added != NULL)
+		return added;
+	added = calloc(1, sizeof(intern_level) + slot_count * sizeof(uint64_t));
+	if (added == NULL)
+	{
+		fprintf(stderr, "Implementation Error: out of memory for identifiers\n");
+		exit(1);
+	}
+	added->mask = slot_count - 1;
+	if (!atomic_compare_exchange_strong_explicit(link, &expected, added, 
+		memory_order_acq_rel, memory_order_acquire))
+	{
+		free(added);
+		return expected;
+	}
+	return added;
+}
+
+// writes name under a new id, nothing refers to it until a slot is published
+uint32_t store_identifier(char name[])
+{
+	uint32_t id = atomic_fetch_add_explicit(&intern_count, 1, memory_order_relaxed);
+	char (*chunk)[IDENTIFIER_LENGTH];
+	char (*expected)[IDENTIFIER_LENGTH] = NULL;
+
+	if (id / INTERN_CHUNK_SIZE >= INTERN_CHUNKS)
+	{
+		fprintf(stderr, "Implementation Error: too many identifiers\n");
+		exit(1);
+	}
+	chunk = atomic_load_explicit(&intern_chunks[id / INTERN_CHUNK_SIZE], memory_order_acquire);
+	if (chunk == NULL)
+	{
+		chunk = calloc(INTERN_CHUNK_SIZE, IDENTIFIER_LENGTH);
+		if (chunk == NULL)
+		{
+			fprintf(stderr, "Implementation Error: out of memory for identifiers\n");
+			exit(1);
+		}
+		if (!atomic_compare_exchange_strong_explicit(&intern_chunks[id / INTERN_CHUNK_SIZE], &expected, chunk, 
+			memory_order_acq_rel, memory_order_acquire))
+		{
+			free(chunk);
+			chunk = expected;
+		}
+	}
+	strncpy(chunk[id % INTERN_CHUNK_SIZE], name, IDENTIFIER_LENGTH - 1);
+	chunk[id % INTERN_CHUNK_SIZE][IDENTIFIER_LENGTH - 1] = '\0';
+	return id;
+}
+
+// the name behind an id intern_identifier() returned, on any thread
+char *identifier_name(uint32_t id)
+{
+	return atomic_load_explicit(&intern_chunks[id / INTERN_CHUNK_SIZE], memory_order_acquire)[id % INTERN_CHUNK_SIZE];
+}
+
+// stores a number literal and returns its index in the number pool
+uint32_t pool_number(int value)
+{
+	number_pool = grow_array(number_pool, &number_capacity, number_count + 1, sizeof(int));
+	number_pool[number_count] = value;
+	return number_count++;
+}
+
+// token accessors, the parser never reads the packed payload directly
+token_type token_type_at(int index)
+{
+	if (index >= token_count && token_source != NULL)
+		receive_tokens(index);
+	return tokens[index].type;
+}
+
+char *token_name(int index)
+{
+	if (index >= token_count && token_source != NULL)
+		receive_tokens(index);
+	return identifier_name(tokens[index].payload);
+}
+
+int token_number(int index)
+{
+	if (index >= token_count && token_source != NULL)
+		receive_tokens(index);
+	return number_pool[tokens[index].payload];
+}
+
+// adds a new symbol to the end of the table
+void add_symbol(int kind, char name[], int value, int level, int address)
+{
+	table[table_index].kind = kind;
+	strcpy(table[table_index].name, name);
+	table[table_index].value = value;
+	table[table_index].level = level;
+	table[table_index].address = address;
+	table[table_index].mark = 0;
+	table[table_index].frame_size = 0;
+	table[table_index].stack_depth = 0;
+	table_index++;
+	table = grow_array(table, &table_capacity, table_index + 1, sizeof(symbol));
+}
+
+// marks all of the current procedure's symbols
+void mark()
+{
+	int i;
+	for (i = table_index - 1; i >= 0; i--)
+	{
+		if (table[i].mark == 1)
+			continue;
+		if (table[i].level < level)
+			return;
+		table[i].mark = 1;
+	}
+}
+
+// returns -1 if there are no other symbols with the same name within this procedure
+int multiple_declaration_check(char name[])
+{
+	int i;
+	for (i = 0; i < table_index; i++)
+		if (table[i].mark == 0 && table[i].level == level && strcmp(name, table[i].name) == 0)
+			return i;
+	return -1;
+}
+
+// returns the index of the symbol with the desired name and kind, prioritizing 
+// 		symbols with level closer to the current level
+int find_symbol(char name[], int kind)
+{
+	int i;
+	int max_idx = -1;
+	int max_lvl = -1;
+	for (i = 0; i < table_index; i++)
+	{
+		if (table[i].mark == 0 && table[i].kind == kind && strcmp(name, table[i].name) == 0)
+		{
+			if (max_idx == -1 || table[i].level > max_lvl)
+			{
+				max_idx = i;
+				max_lvl = table[i].level;
+			}
+		}
+	}
+	return max_idx;
+}
+
+// adds a call target the module doesn't declare, it lives in main's scope 
+// 		like every exported procedure. the row is marked straight away so 
+// 		mark() doesn't stop at its level, later calls add their own row
+int declare_external(char name[])
+{
+	int external = 0;
+
+	while (external < external_count && strcmp(external_names[external], name) != 0)
+		external++;
+	if (external == external_count)
+	{
+		external_names = grow_array(external_names, &external_capacity, external_count + 1, IDENTIFIER_LENGTH);
+		strcpy(external_names[external_count++], name);
+	}
+	add_symbol(3, name, 0, 0, -3 * (external + 1));
+	table[table_index - 1].mark = 1;
+	return table_index - 1;
+}
+
+// records a parser error, the caller still sets error and returns
+void parser_error(int error_code, int case_code)
+{
+	add_diagnostic(parser_diagnostic, error_code, case_code);
+}
+
+// records a lexical error
+void lexer_error(int error_code)
+{
+	add_diagnostic(lexer_diagnostic, error_code, 0);
+}
+
+void add_diagnostic(diagnostic_kind kind, int error_code, int case_code)
+{
+	diagnostics = grow_array(diagnostics, &diagnostic_capacity, diagnostic_count + 1, sizeof(diagnostic));
+	diagnostics[diagnostic_count].kind = kind;
+	diagnostics[diagnostic_count].error_code = error_code;
+	diagnostics[diagnostic_count].case_code = case_code;
+	diagnostics[diagnostic_count].token_index = token_index;
+	diagnostic_count++;
+}
+
+// index of the span instruction is in, -1 if it comes before the first one
+int find_source_span(const source_span *map, int length, int instruction)
+{
+	int low = 0;
+	int high = length - 1;
+	int found = -1;
+	int middle;
+
+	while (low <= high)
+	{
+		middle = (low + high) / 2;
+		if (map[middle].first_instruction <= instruction)
+		{
+			found = middle;
+			low = middle + 1;
+		}
+		else
+			high = middle - 1;
+	}
+	return found;
+}
+
+const char *diagnostic_message(const diagnostic *entry)
+{
+	if (entry->kind == lexer_diagnostic)
+		return lexer_error_message(entry->error_code);
+	return parser_error_message(entry->error_code, entry->case_code);
+}
+
+// prints every error recorded by the last compilation in order
+void print_diagnostics(FILE *ofp)
+{
+	int i;
+	for (i = 0; i < diagnostic_count; i++)
+		fprintf(ofp, "%s\n", diagnostic_message(&diagnostics[i]));
+}
+
+const char *lexer_error_message(int error_code)
+{
+	switch (error_code)
+	{
 		case 1 :
-			printf("Parser Error 1: missing . \n");
-			break;
+			return "Lexical Error: identifier names cannot exceed 11 characters";
+		case 2 :
+			return "Lexical Error: numbers cannot exceed 5 digits";
+		case 3 :
+			return "Lexical Error: invalid symbol";
+		case 4 :
+			return "Lexical Error: never-ending comment";
+		case 5 :
+			return "Lexical Error: identifiers cannot begin with digits";
+		case 6 :
+			return "Lexical Error: invalid token";
+		default:
+			return "Implementation Error: unrecognized error code";
+	}
+}
+
+const char *parser_error_message(int error_code, int case_code)
+{
+	switch (error_code)
+	{
+		case 1 :
+			return "Parser Error 1: missing . ";
 		case 2 :
 			switch (case_code)
 			{
 				case 1 :
-					printf("Parser Error 2: missing identifier after keyword const\n");
-					break;
+					return "Parser Error 2: missing identifier after keyword const";
 				case 2 :
-					printf("Parser Error 2: missing identifier after keyword var\n");
-					break;
+					return "Parser Error 2: missing identifier after keyword var";
 				case 3 :
-					printf("Parser Error 2: missing identifier after keyword procedure\n");
-					break;
+					return "Parser Error 2: missing identifier after keyword procedure";
 				case 4 :
-					printf("Parser Error 2: missing identifier after keyword call\n");
-					break;
+					return "Parser Error 2: missing identifier after keyword call";
 				case 5 :
-					printf("Parser Error 2: missing identifier after keyword read\n");
-					break;
+					return "Parser Error 2: missing identifier after keyword read";
 				case 6 :
-					printf("Parser Error 2: missing identifier after keyword def\n");
-					break;
+					return "Parser Error 2: missing identifier after keyword def";
 				default :
-					printf("Implementation Error: unrecognized error code\n");
+					return "Implementation Error: unrecognized error code";
 			}
-			break;
 		case 3 :
-			printf("Parser Error 3: identifier is declared multiple times by a procedure\n");
-			break;
+			return "Parser Error 3: identifier is declared multiple times by a procedure";
 		case 4 :
 			switch (case_code)
 			{
 				case 1 :
-					printf("Parser Error 4: missing := in constant declaration\n");
-					break;
+					return "Parser Error 4: missing := in constant declaration";
 				case 2 :
-					printf("Parser Error 4: missing := in assignment statement\n");
-					break;
+					return "Parser Error 4: missing := in assignment statement";
 				default :				
-					printf("Implementation Error: unrecognized error code\n");
+					return "Implementation Error: unrecognized error code";
 			}
-			break;
 		case 5 :
-			printf("Parser Error 5: missing number in constant declaration\n");
-			break;
+			return "Parser Error 5: missing number in constant declaration";
 		case 6 :
 			switch (case_code)
 			{
 				case 1 :
-					printf("Parser Error 6: missing ; after constant declaration\n");
+					return "Parser Error 6: missing ; after constant declaration";
+				case 2 :
+					return "Parser Error 6: missing ; after variable declaration";
+				case 3 :
+					return "Parser Error 6: missing ; after statement in begin-end";
+				default :				
+					return "Implementation Error: unrecognized error code";
+			}
+		case 7 :
+			return "Parser Error 7: procedures and constants cannot be assigned to";
+		case 8 :
+			switch (case_code)
+			{
+				case 1 :
+					return "Parser Error 8: undeclared identifier used in assignment statement";
+				case 2 :
+					return "Parser Error 8: undeclared identifier used in call statement";
+				case 3 :
+					return "Parser Error 8: undeclared identifier used in read statement";
+				case 4 :
+					return "Parser Error 8: undeclared identifier used in arithmetic expression";
+				default :				
+					return "Implementation Error: unrecognized error code";
+			}
+		case 9 :
+			return "Parser Error 9: variables and constants cannot be called";
+		case 10 :
+			return "Parser Error 10: begin must be followed by end";
+		case 11 :
+			return "Parser Error 11: if must be followed by then";
+		case 12 :
+			return "Parser Error 12: while must be followed by do";
+		case 13 :
+			return "Parser Error 13: procedures and constants cannot be read";
+		case 14 :
+			return "Parser Error 14: missing {";
+		case 15 :
+			return "Parser Error 15: { must be followed by }";
+		case 16 :
+			return "Parser Error 16: missing relational operator";
+		case 17 :
+			return "Parser Error 17: procedures cannot be used in arithmetic";
+		case 18 :
+			return "Parser Error 18: ( must be followed by )";
+		case 19 :
+			return "Parser Error 19: invalid expression";
+		case 20 :
+			return "Implementation Error: out of memory";
+		default:
+			return "Implementation Error: unrecognized error code";
+
+	}
+}
+
+void print_assembly_code(FILE *ofp)
+{
+	int i;
+
+	trace_begin("print assembly code", -1, 0);
+	fprintf(ofp, "Assembly Code:\n");
+	fprintf(ofp, "Line\tOP Code\tOP Name\tL\tM\n");
+	for (i = 0; i < code_index; i++)
+		print_instruction(ofp, i, &code[i]);
+	fprintf(ofp, "\n");
+	trace_end("print assembly code");
+}
+
+// one line of the listing
+void print_instruction(FILE *ofp, int line, const instruction *ir)
+{
+	fprintf(ofp, "%d\t%d\t", line, ir->op);
+	switch(ir->op)
+	{
+		case LIT :
+			fprintf(ofp, "LIT\t");
+			break;
+		case OPR :
+			switch (ir->m)
+			{
+				case RTN :
+					fprintf(ofp, "RTN\t");
+					break;
+				case ADD :
+					fprintf(ofp, "ADD\t");
+					break;
+				case SUB :
+					fprintf(ofp, "SUB\t");
+					break;
+				case MUL :
+					fprintf(ofp, "MUL\t");
+					break;
+				case DIV :
+					fprintf(ofp, "DIV\t");
+					break;
+				case EQL :
+					fprintf(ofp, "EQL\t");
+					break;
+				case NEQ :
+					fprintf(ofp, "NEQ\t");
+					break;
+				case LSS :
+					fprintf(ofp, "LSS\t");
+					break;
+				case LEQ :
+					fprintf(ofp, "LEQ\t");
+					break;
+				case GTR :
+					fprintf(ofp, "GTR\t");
+					break;
+				case GEQ :
+					fprintf(ofp, "GEQ\t");
+					break;
+				default :
+					fprintf(ofp, "err\t");
+					break;
+			}
+			break;
+		case LOD :
+			fprintf(ofp, "LOD\t");
+			break;
+		case STO :
+			fprintf(ofp, "STO\t");
+			break;
+		case CAL :
+			fprintf(ofp, "CAL\t");
+			break;
+		case TCL :
+			fprintf(ofp, "TCL\t");
+			break;
+		case LDG :
+			fprintf(ofp, "LDG\t");
+			break;
+		case STG :
+			fprintf(ofp, "STG\t");
+			break;
+		case SIM :
+			fprintf(ofp, "SIM\t");
+			break;
+		case RDS :
+			fprintf(ofp, "RDS\t");
+			break;
+		case CPY :
+			fprintf(ofp, "CPY\t");
+			break;
+		case INC :
+			fprintf(ofp, "INC\t");
+			break;
+		case JMP :
+			fprintf(ofp, "JMP\t");
+			break;
+		case JPC :
+			fprintf(ofp, "JPC\t");
+			break;
+		case CJP :
+			fprintf(ofp, "CJP\t");
+			break;
+		case SYS :
+			switch (ir->m)
+			{
+				case WRT : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
+					fprintf(ofp, "WRT\t");
+					break;
+				case RED :
+					fprintf(ofp, "RED\t");
+					break;
+				case HLT :
+					fprintf(ofp, "HLT\t");
+					break;
+				default :
+					fprintf(ofp, "err\t");
+					break;
+			}
+			break;
+		default :
+			fprintf(ofp, "err\t");
+			break;
+	}
+	fprintf(ofp, "%d\t%d\n", ir->l, ir->m);
+}
+
+void print_symbol_table(FILE *ofp)
+{
+	int i;
+
+	trace_begin("print symbol table", -1, 0);
+	fprintf(ofp, "Symbol Table:\n");
+	fprintf(ofp, "Kind | Name        | Value | Level | Address | Mark\n");
+	fprintf(ofp, "---------------------------------------------------\n");
+	for (i = 0; i < table_index; i++)
+		fprintf(ofp, "%4d | %11s | %5d | %5d | %5d | %5d\n", table[i].kind, table[i].name, table[i].value, table[i].level, table[i].address, table[i].mark); 
+	fprintf(ofp, "\n");
+	trace_end("print symbol table");
+}
+
+// finds where every procedure in the table was emitted, in table order so 
+// 		main comes first. returns how many there are
+int find_procedures(procedure_range *ranges)
+{
+	int count = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < table_index; i++)
+	{
+		if (table[i].kind != 3 || table[i].address < 0)
+			continue;
+		ranges[count].symbol = i;
+		ranges[count].first = table[i].address / 3;
+		for (j = ranges[count].first; j < code_index; j++)
+			if ((code[j].op == OPR && code[j].m == RTN) || (code[j].op == SYS && code[j].m == HLT))
+				break;
+		ranges[count].last = j < code_index ? j : code_index - 1;
+		count++;
+	}
+	return count;
+}
+
+// a procedure's statements run one level inside the level it was declared 
+// 		at, except main whose symbol is added at level 0 with its block
+int procedure_block_level(int symbol_index)
+{
+	return symbol_index == 0 ? 0 : table[symbol_index].level + 1;
+}
+
+// the procedure whose block declared this symbol, -1 for main. that is the 
+// 		closest procedure before it in the table whose block is at the 
+// 		symbol's level, anything in between belongs to a deeper block
+int enclosing_procedure(int symbol_index)
+{
+	int i;
+
+	if (symbol_index == 0)
+		return -1;
+	for (i = symbol_index - 1; i >= 0; i--)
+		if (table[i].kind == 3 && procedure_block_level(i) == table[symbol_index].level)
+			return i;
+	return -1;
+}
+
+// finds the range of every procedure's lexical parent, -1 for main
+void find_procedure_parents(procedure_range *ranges, int count, int *parents)
+{
+	int parent;
+	int i;
+	int j;
+
+	for (i = 0; i < count; i++)
+	{
+		parents[i] = -1;
+		parent = enclosing_procedure(ranges[i].symbol);
+		for (j = 0; j < count; j++)
+			if (ranges[j].symbol == parent)
+				parents[i] = j;
+	}
+}
+
+// marks every instruction a JMP, JPC or CJP can land on, arena allocated
+bool *find_jump_targets()
+{
+	bool *targets = compile_allocate((code_index + 1) * sizeof(bool));
+	int i;
+
+	memset(targets, 0, (code_index + 1) * sizeof(bool));
+	for (i = 0; i < code_index; i++)
+		if ((code[i].op == JMP || code[i].op == JPC || code[i].op == CJP) && 
+			code[i].m / 3 >= 0 && code[i].m / 3 <= code_index)
+			targets[code[i].m / 3] = true;
+	return targets;
+}
+
+// deletes the marked instructions and relocates jump and call targets and 
+// 		procedure addresses. a jump to a deleted instruction lands on the 
+// 		next one that survives
+void remove_instructions(bool *removed)
+{
+	int *position = compile_allocate((code_index + 1) * sizeof(int));
+	int kept = 0;
+	int i;
+
+	for (i = 0; i < code_index; i++)
+	{
+		position[i] = kept;
+		if (!removed[i])
+			kept++;
+	}
+	position[code_index] = kept;
+
+	for (i = 0; i < code_index; i++)
+		if ((code[i].op == JMP || code[i].op == JPC || code[i].op == CJP || code[i].op == CAL || 
+			code[i].op == TCL) && code[i].m / 3 >= 0 && code[i].m / 3 <= code_index)
+			code[i].m = position[code[i].m / 3] * 3;
+	for (i = 0; i < table_index; i++)
+		if (table[i].kind == 3 && table[i].address >= 0)
+			table[i].address = position[table[i].address / 3] * 3;
+
+	kept = 0;
+	for (i = 0; i < code_index; i++)
+		if (!removed[i])
+		{
+			code_sources[kept] = code_sources[i];
+			code[kept++] = code[i];
+		}
+	code_index = kept;
+}
+
+// translates the compiled program to standalone C. every procedure becomes a 
+// 		function and CAL a direct call, frames stay on an explicit stack 
+// 		laid out exactly like the VM's so the program behaves the same
+void print_c_code(FILE *ofp)
+{
+	procedure_range *ranges = compile_allocate(table_index * sizeof(procedure_range));
+	int *procedure_of_entry = compile_allocate((code_index + 1) * sizeof(int));
+	bool *targets = compile_allocate((code_index + 1) * sizeof(bool));
+	int count = find_procedures(ranges);
+	bool uses_frame;
+	bool uses_base;
+	int i;
+	int j;
+
+	trace_begin("print c code", -1, 0);
+
+	for (i = 0; i <= code_index; i++)
+		procedure_of_entry[i] = -1;
+	for (i = 0; i < count; i++)
+		procedure_of_entry[ranges[i].first] = ranges[i].symbol;
+
+	fprintf(ofp, "#include <stdio.h>\n");
+	fprintf(ofp, "#include <stdlib.h>\n\n");
+	fprintf(ofp, "#define STACK_SIZE %d\n\n", VM_STACK_SIZE);
+	fprintf(ofp, "static int stack[STACK_SIZE];\n");
+	fprintf(ofp, "static int bp = 0;\n");
+	fprintf(ofp, "static int sp = -1;\n\n");
+	fprintf(ofp, "static inline int base(int l)\n{\n\tint b = bp;\n\twhile (l-- > 0)\n\t\tb = stack[b];\n\treturn b;\n}\n\n");
+	fprintf(ofp, "static int read_value(void)\n{\n\tint value = 0;\n\tif (scanf(\"%%d\", &value) != 1)\n\t\tvalue = 0;\n\treturn value;\n}\n\n");
+	fprintf(ofp, "static void fail(const char *message)\n{\n\tprintf(\"%%s\\n\", message);\n\texit(1);\n}\n\n");
+
+	for (i = 0; i < count; i++)
+	{
+		fprintf(ofp, "static void ");
+		print_c_procedure_name(ofp, ranges[i].symbol);
+		fprintf(ofp, "(void);\n");
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		fprintf(ofp, "\nstatic void ");
+		print_c_procedure_name(ofp, ranges[i].symbol);
+		fprintf(ofp, "(void)\n{\n");
+		// labels only go where this procedure's own jumps land
+		uses_frame = false;
+		uses_base = false;
+		for (j = ranges[i].first; j <= ranges[i].last; j++)
+			targets[j] = false;
+		for (j = ranges[i].first; j <= ranges[i].last; j++)
+		{
+			if ((code[j].op == JMP || code[j].op == JPC || code[j].op == CJP) && 
+				code[j].m / 3 >= ranges[i].first && code[j].m / 3 <= ranges[i].last)
+				targets[code[j].m / 3] = true;
+			if ((code[j].op == LOD || code[j].op == STO || code[j].op == CPY) && code[j].l == 0)
+				uses_frame = true;
+			// superinstructions call base() inline for their operands
+			if ((code[j].op == LOD || code[j].op == STO) && code[j].l != 0 && (j == ranges[i].first || 
+				(code[j - 1].op != SIM && code[j - 1].op != RDS && code[j - 1].op != CPY)))
+				uses_base = true;
+		}
+		if (uses_frame)
+			fprintf(ofp, "\tint *frame = stack + bp;\n");
+		if (uses_base)
+			fprintf(ofp, "\tint b;\n");
+		if (uses_frame || uses_base)
+			fprintf(ofp, "\n");
+
+		for (j = ranges[i].first; j <= ranges[i].last; j++)
+		{
+			instruction *ir = &code[j];
+			if (targets[j])
+				fprintf(ofp, "L%d:\n", j);
+			fprintf(ofp, "\t");
+			switch (ir->op)
+			{
+				case LIT :
+					fprintf(ofp, "stack[++sp] = %d;\n", ir->m);
+					break;
+				case OPR :
+					switch (ir->m)
+					{
+						case RTN :
+							fprintf(ofp, "sp = bp - 1;\n\tbp = stack[sp + 2];\n\treturn;\n");
+							break;
+						case ADD : fprintf(ofp, "sp--;\n\tstack[sp] = (int) ((unsigned) stack[sp] + (unsigned) stack[sp + 1]);\n"); break;
+						case SUB : fprintf(ofp, "sp--;\n\tstack[sp] = (int) ((unsigned) stack[sp] - (unsigned) stack[sp + 1]);\n"); break;
+						case MUL : fprintf(ofp, "sp--;\n\tstack[sp] = (int) ((unsigned) stack[sp] * (unsigned) stack[sp + 1]);\n"); break;
+						case DIV :
+							fprintf(ofp, "sp--;\n\tif (stack[sp + 1] == 0)\n\t\tfail(\"Runtime Error: division by zero\");\n");
+							fprintf(ofp, "\tstack[sp] = stack[sp + 1] == -1 ? (int) (0u - (unsigned) stack[sp]) : stack[sp] / stack[sp + 1];\n");
+							break;
+						case EQL : fprintf(ofp, "sp--;\n\tstack[sp] = stack[sp] == stack[sp + 1];\n"); break;
+						case NEQ : fprintf(ofp, "sp--;\n\tstack[sp] = stack[sp] != stack[sp + 1];\n"); break;
+						case LSS : fprintf(ofp, "sp--;\n\tstack[sp] = stack[sp] < stack[sp + 1];\n"); break;
+						case LEQ : fprintf(ofp, "sp--;\n\tstack[sp] = stack[sp] <= stack[sp + 1];\n"); break;
+						case GTR : fprintf(ofp, "sp--;\n\tstack[sp] = stack[sp] > stack[sp + 1];\n"); break;
+						case GEQ : fprintf(ofp, "sp--;\n\tstack[sp] = stack[sp] >= stack[sp + 1];\n"); break;
+						default : fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
+					}
+					break;
+				case LOD :
+					if (ir->l == 0)
+						fprintf(ofp, "stack[++sp] = frame[%d];\n", ir->m);
+					else
+						fprintf(ofp, "b = base(%d);\n\tstack[++sp] = stack[b + %d];\n", ir->l, ir->m);
+					break;
+				case STO :
+					if (ir->l == 0)
+						fprintf(ofp, "frame[%d] = stack[sp--];\n", ir->m);
+					else
+						fprintf(ofp, "b = base(%d);\n\tstack[b + %d] = stack[sp--];\n", ir->l, ir->m);
+					break;
+				case LDG :
+					fprintf(ofp, "stack[++sp] = stack[%d];\n", ir->m);
+					break;
+				case SIM :
+				case RDS :
+				case CPY :
+					// the store in the next word becomes part of this statement
+					if (j + 1 > ranges[i].last)
+					{
+						fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
+						break;
+					}
+					if (code[j + 1].op == STG)
+						fprintf(ofp, "stack[%d] = ", code[j + 1].m);
+					else if (code[j + 1].l == 0)
+						fprintf(ofp, "frame[%d] = ", code[j + 1].m);
+					else
+						fprintf(ofp, "stack[base(%d) + %d] = ", code[j + 1].l, code[j + 1].m);
+					if (ir->op == SIM)
+						fprintf(ofp, "%d;\n", ir->m);
+					else if (ir->op == RDS)
+						fprintf(ofp, "read_value();\n");
+					else if (ir->l == 0)
+						fprintf(ofp, "frame[%d];\n", ir->m);
+					else
+						fprintf(ofp, "stack[base(%d) + %d];\n", ir->l, ir->m);
+					j++;
+					break;
+				case STG :
+					fprintf(ofp, "stack[%d] = stack[sp--];\n", ir->m);
 					break;
-				case 2 :
-					printf("Parser Error 6: missing ; after variable declaration\n");
+				case CAL :
+					if (ir->m / 3 < 0 || ir->m / 3 > code_index || procedure_of_entry[ir->m / 3] == -1)
+					{
+						fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
+						break;
+					}
+					fprintf(ofp, "if (sp + 3 >= STACK_SIZE)\n\t\tfail(\"Runtime Error: stack overflow\");\n");
+					fprintf(ofp, "\tstack[sp + 1] = base(%d);\n\tstack[sp + 2] = bp;\n\tstack[sp + 3] = %d;\n\tbp = sp + 1;\n\t", ir->l, (j + 1) * 3);
+					print_c_procedure_name(ofp, procedure_of_entry[ir->m / 3]);
+					fprintf(ofp, "();\n");
 					break;
-				case 3 :
-					printf("Parser Error 6: missing ; after statement in begin-end\n");
+				case TCL :
+					// the callee's RTN pops this frame, a C compiler turns the 
+					// call into a jump
+					if (ir->m / 3 < 0 || ir->m / 3 > code_index || procedure_of_entry[ir->m / 3] == -1)
+					{
+						fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
+						break;
+					}
+					fprintf(ofp, "stack[bp] = base(%d);\n\tsp = bp - 1;\n\t", ir->l);
+					print_c_procedure_name(ofp, procedure_of_entry[ir->m / 3]);
+					fprintf(ofp, "();\n\treturn;\n");
 					break;
-				default :				
-					printf("Implementation Error: unrecognized error code\n");
-			}
-			break;
-		case 7 :
-			printf("Parser Error 7: procedures and constants cannot be assigned to\n");
-			break;
-		case 8 :
-			switch (case_code)
-			{
-				case 1 :
-					printf("Parser Error 8: undeclared identifier used in assignment statement\n");
+				case INC :
+					fprintf(ofp, "sp += %d;\n\tif (sp >= STACK_SIZE)\n\t\tfail(\"Runtime Error: stack overflow\");\n", ir->m);
 					break;
-				case 2 :
-					printf("Parser Error 8: undeclared identifier used in call statement\n");
+				case JMP :
+					if (ir->m / 3 < ranges[i].first || ir->m / 3 > ranges[i].last)
+						fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
+					else
+						fprintf(ofp, "goto L%d;\n", ir->m / 3);
 					break;
-				case 3 :
-					printf("Parser Error 8: undeclared identifier used in read statement\n");
+				case JPC :
+					if (ir->m / 3 < ranges[i].first || ir->m / 3 > ranges[i].last)
+						fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
+					else
+						fprintf(ofp, "if (stack[sp--] == 0)\n\t\tgoto L%d;\n", ir->m / 3);
 					break;
-				case 4 :
-					printf("Parser Error 8: undeclared identifier used in arithmetic expression\n");
+				case CJP :
+					if (ir->m / 3 < ranges[i].first || ir->m / 3 > ranges[i].last || ir->l < EQL || ir->l > GEQ)
+						fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
+					else
+						fprintf(ofp, "sp -= 2;\n\tif (!(stack[sp + 1] %s stack[sp + 2]))\n\t\tgoto L%d;\n", 
+							c_relations[ir->l - EQL], ir->m / 3);
 					break;
-				default :				
-					printf("Implementation Error: unrecognized error code\n");
+				case SYS :
+					switch (ir->m)
+					{
+						case WRT : fprintf(ofp, "printf(\"%%d\\n\", stack[sp--]);\n"); break;
+						case RED : fprintf(ofp, "stack[++sp] = read_value();\n"); break;
+						case HLT : fprintf(ofp, "exit(0);\n"); break;
+						default : fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
+					}
+					break;
+				default :
+					fprintf(ofp, "fail(\"Runtime Error: invalid instruction\");\n");
 			}
-			break;
-		case 9 :
-			printf("Parser Error 9: variables and constants cannot be called\n");
-			break;
-		case 10 :
-			printf("Parser Error 10: begin must be followed by end\n");
-			break;
-		case 11 :
-			printf("Parser Error 11: if must be followed by then\n");
-			break;
-		case 12 :
-			printf("Parser Error 12: while must be followed by do\n");
-			break;
-		case 13 :
-			printf("Parser Error 13: procedures and constants cannot be read\n");
-			break;
-		case 14 :
-			printf("Parser Error 14: missing {\n");
-			break;
-		case 15 :
-			printf("Parser Error 15: { must be followed by }\n");
-			break;
-		case 16 :
-			printf("Parser Error 16: missing relational operator\n");
-			break;
-		case 17 :
-			printf("Parser Error 17: procedures cannot be used in arithmetic\n");
-			break;
-		case 18 :
-			printf("Parser Error 18: ( must be followed by )\n");
-			break;
-		case 19 :
-			printf("Parser Error 19: invalid expression\n");
-			break;
-		default:
-			printf("Implementation Error: unrecognized error code\n");
+		}
+		fprintf(ofp, "}\n");
+	}
+
+	fprintf(ofp, "\nint main(void)\n{\n\t");
+	print_c_procedure_name(ofp, ranges[0].symbol);
+	fprintf(ofp, "();\n\treturn 0;\n}\n");
+	trace_end("print c code");
+}
+
+// procedures can share names across scopes, so the table index disambiguates
+void print_c_procedure_name(FILE *ofp, int symbol_index)
+{
+	fprintf(ofp, "proc_%s_%d", table[symbol_index].name, symbol_index);
+}
+
+// runs the passes set_optimizations() asked for over the finished program
+void optimize_program()
+{
+	// inlining runs to a fixed point, a caller whose calls all got inlined 
+	// can be inlined into its own callers on the next round
+	if (optimizations & optimize_inline)
+		while (inline_calls())
+			;
+	// a module's procedures can be called from other modules, so none are dead
+	if ((optimizations & optimize_dead_procedures) && !module_mode)
+		eliminate_dead_procedures();
+	if (optimizations & optimize_frames)
+		shrink_frames();
+	if (optimizations & optimize_tail_calls)
+		convert_tail_calls();
+	// merging can make callers identical too, so it also runs to a fixed 
+	// point. other modules call a module's procedures by name
+	if ((optimizations & optimize_merge_procedures) && !module_mode)
+	{
+		while (merge_procedures())
+			;
+		// procedures nested in a merged copy are left with no callers
+		if (optimizations & optimize_dead_procedures)
+			eliminate_dead_procedures();
+	}
+	// these have to come last, the other passes don't know the fused opcodes
+	if (optimizations & optimize_branches)
+		fuse_compare_branches();
+	if (optimizations & optimize_superinstructions)
+		select_superinstructions();
+}
+
+// drops the code of every procedure main can't reach through a chain of CALs
+void eliminate_dead_procedures()
+{
+	procedure_range *ranges = compile_allocate(table_index * sizeof(procedure_range));
+	int *range_of_entry = compile_allocate((code_index + 1) * sizeof(int));
+	int *worklist = compile_allocate(table_index * sizeof(int));
+	bool *reached = compile_allocate(table_index * sizeof(bool));
+	bool *removed = compile_allocate(code_index * sizeof(bool));
+	int count = find_procedures(ranges);
+	int pending = 0;
+	bool any_removed = false;
+	int target;
+	int r;
+	int i;
+
+	for (i = 0; i <= code_index; i++)
+		range_of_entry[i] = -1;
+	for (r = 0; r < count; r++)
+	{
+		range_of_entry[ranges[r].first] = r;
+		reached[r] = false;
+	}
+
+	// main is always the first range
+	reached[0] = true;
+	worklist[pending++] = 0;
+	while (pending > 0)
+	{
+		r = worklist[--pending];
+		for (i = ranges[r].first; i <= ranges[r].last; i++)
+		{
+			if ((code[i].op != CAL && code[i].op != TCL) || code[i].m / 3 < 0 || code[i].m / 3 > code_index)
+				continue;
+			target = range_of_entry[code[i].m / 3];
+			if (target != -1 && !reached[target])
+			{
+				reached[target] = true;
+				worklist[pending++] = target;
+			}
+		}
+	}
+
+	memset(removed, 0, code_index * sizeof(bool));
+	for (r = 0; r < count; r++)
+	{
+		if (reached[r])
+			continue;
+		for (i = ranges[r].first; i <= ranges[r].last; i++)
+			removed[i] = true;
+		table[ranges[r].symbol].address = -1;
+		any_removed = true;
+	}
+	if (!any_removed)
+		return;
+
+	// variables of a dead procedure go with it
+	for (i = 0; i < table_index; i++)
+		if (table[i].kind == 2 && enclosing_procedure(i) != -1 && table[enclosing_procedure(i)].address == -1)
+			table[i].address = -1;
+	remove_instructions(removed);
+}
+
+// renumbers each frame's variable slots so only variables that are read keep 
+// 		one, and shrinks the INC that allocates the frame. a store to a 
+// 		variable nobody reads goes away together with the LIT or LOD that 
+// 		pushed its value, a store after RED has to pop something so its 
+// 		variable keeps a slot
+void shrink_frames()
+{
+	procedure_range *ranges = compile_allocate(table_index * sizeof(procedure_range));
+	int count = find_procedures(ranges);
+	int *parents = compile_allocate(count * sizeof(int));
+	int *owners = compile_allocate(code_index * sizeof(int));
+	int **slots = compile_allocate(count * sizeof(int *));
+	int *frame_sizes = compile_allocate(count * sizeof(int));
+	bool *fixed = compile_allocate(count * sizeof(bool));
+	bool *removed = compile_allocate(code_index * sizeof(bool));
+	bool *targets = find_jump_targets();
+	bool any_removed = false;
+	int owner;
+	int kept;
+	int r;
+	int i;
+	int j;
+
+	find_procedure_parents(ranges, count, parents);
+	memset(removed, 0, code_index * sizeof(bool));
+
+	// slots[r][m] is 0 while slot m of r's frame looks unused, 1 once it is 
+	// read or stored by something that can't be deleted, and 2 for a 
+	// variable that is only ever written by deletable stores
+	for (r = 0; r < count; r++)
+	{
+		frame_sizes[r] = code[ranges[r].first].op == INC ? code[ranges[r].first].m : 0;
+		slots[r] = compile_allocate((frame_sizes[r] + 1) * sizeof(int));
+		memset(slots[r], 0, (frame_sizes[r] + 1) * sizeof(int));
+		fixed[r] = frame_sizes[r] < 3;
+	}
+
+	for (r = 0; r < count; r++)
+		for (i = ranges[r].first; i <= ranges[r].last; i++)
+		{
+			owners[i] = -1;
+			if (code[i].op != LOD && code[i].op != STO && code[i].op != LDG && code[i].op != STG)
+				continue;
+			// main is always the first range, LDG and STG have L = 0
+			owner = code[i].op == LDG || code[i].op == STG ? 0 : r;
+			for (j = 0; j < code[i].l && owner != -1; j++)
+				owner = parents[owner];
+			owners[i] = owner;
+			if (owner == -1 || fixed[owner])
+				continue;
+			if (code[i].m < 3 || code[i].m >= frame_sizes[owner])
+			{
+				// something addresses the frame in a way we don't understand
+				fixed[owner] = true;
+				continue;
+			}
+			if ((code[i].op == STO || code[i].op == STG) && i > ranges[r].first && !targets[i] && 
+				!targets[i - 1] && (code[i - 1].op == LIT || code[i - 1].op == LOD || code[i - 1].op == LDG))
+			{
+				if (slots[owner][code[i].m] == 0)
+					slots[owner][code[i].m] = 2;
+			}
+			else
+				slots[owner][code[i].m] = 1;
+		}
+
+	// number the surviving slots and delete the stores nobody reads
+	for (r = 0; r < count; r++)
+	{
+		if (fixed[r])
+			continue;
+		kept = 3;
+		for (i = 3; i < frame_sizes[r]; i++)
+			slots[r][i] = slots[r][i] == 1 ? kept++ : -1;
+		code[ranges[r].first].m = kept;
+	}
+	for (r = 0; r < count; r++)
+		for (i = ranges[r].first; i <= ranges[r].last; i++)
+		{
+			owner = owners[i];
+			if (owner == -1 || fixed[owner])
+				continue;
+			if (slots[owner][code[i].m] == -1)
+			{
+				removed[i] = true;
+				removed[i - 1] = true;
+				any_removed = true;
+			}
+			else
+				code[i].m = slots[owner][code[i].m];
+		}
 
+	// keep the symbol table in step with the new slots
+	for (i = 0; i < table_index; i++)
+	{
+		if (table[i].kind != 2 || table[i].address < 3)
+			continue;
+		owner = -1;
+		for (r = 0; r < count; r++)
+			if (ranges[r].symbol == enclosing_procedure(i))
+				owner = r;
+		if (owner != -1 && !fixed[owner] && table[i].address < frame_sizes[owner])
+			table[i].address = slots[owner][table[i].address];
 	}
+
+	if (any_removed)
+		remove_instructions(removed);
 }
 
-void print_assembly_code()
+// replaces every CAL of a small procedure that makes no calls of its own with 
+// 		a copy of its body. the callee's variables move into extra slots 
+// 		at the end of the caller's frame, its non-local accesses are 
+// 		re-leveled to go through the caller's static chain, and its JMP 
+// 		and JPC targets move with the copy. returns whether it inlined any
+bool inline_calls()
 {
+	procedure_range *ranges = compile_allocate(table_index * sizeof(procedure_range));
+	int count = find_procedures(ranges);
+	int *range_of_entry = compile_allocate((code_index + 1) * sizeof(int));
+	int *callee_of = compile_allocate(code_index * sizeof(int));
+	int *site_base = compile_allocate(code_index * sizeof(int));
+	int *slot_base = compile_allocate(count * sizeof(int));
+	int *position = compile_allocate((code_index + 1) * sizeof(int));
+	bool *inlinable = compile_allocate(count * sizeof(bool));
+	instruction *inlined;
+	int *inlined_sources;
+	bool *relocated;
+	int new_length = code_index;
+	bool any_inlined = false;
+	int callee;
+	int first;
+	int out;
+	int r;
 	int i;
-	printf("Assembly Code:\n");
-	printf("Line\tOP Code\tOP Name\tL\tM\n");
+	int j;
+
+	for (i = 0; i <= code_index; i++)
+		range_of_entry[i] = -1;
+	for (r = 0; r < count; r++)
+		range_of_entry[ranges[r].first] = r;
+
+	// main can't be inlined, and neither can anything that calls
+	for (r = 0; r < count; r++)
+	{
+		inlinable[r] = ranges[r].symbol != 0 && code[ranges[r].first].op == INC && 
+			code[ranges[r].last].op == OPR && code[ranges[r].last].m == RTN && 
+			ranges[r].last - ranges[r].first - 1 <= inline_limit;
+		for (i = ranges[r].first; i <= ranges[r].last && inlinable[r]; i++)
+			if (code[i].op == CAL || code[i].op == TCL)
+				inlinable[r] = false;
+	}
+
 	for (i = 0; i < code_index; i++)
 	{
-		printf("%d\t%d\t", i, code[i].op);
-		switch(code[i].op)
+		callee_of[i] = -1;
+		if (code[i].op != CAL || code[i].m / 3 < 0 || code[i].m / 3 > code_index)
+			continue;
+		callee = range_of_entry[code[i].m / 3];
+		if (callee != -1 && inlinable[callee])
 		{
-			case LIT :
-				printf("LIT\t");
-				break;
-			case OPR :
-				switch (code[i].m)
-				{
-					case RTN :
-						printf("RTN\t");
-						break;
-					case ADD : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("ADD\t");
-						break;
-					case SUB : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("SUB\t");
-						break;
-					case MUL : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("MUL\t");
-						break;
-					case DIV : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("DIV\t");
-						break;
-					case EQL : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("EQL\t");
-						break;
-					case NEQ : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("NEQ\t");
-						break;
-					case LSS : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("LSS\t");
-						break;
-					case LEQ : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("LEQ\t");
-						break;
-					case GTR : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("GTR\t");
-						break;
-					case GEQ : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("GEQ\t");
-						break;
-					default :
-						printf("err\t");
-						break;
-				}
+			callee_of[i] = callee;
+			new_length += ranges[callee].last - ranges[callee].first - 2;
+			any_inlined = true;
+		}
+	}
+	if (!any_inlined)
+		return false;
+
+	// every callee inlined into a caller gets one block of slots at the end 
+	// of its frame, shared by all of its call sites since they can't overlap
+	for (r = 0; r < count; r++)
+	{
+		for (j = 0; j < count; j++)
+			slot_base[j] = -1;
+		for (i = ranges[r].first; i <= ranges[r].last; i++)
+		{
+			callee = callee_of[i];
+			if (callee == -1)
+				continue;
+			if (slot_base[callee] == -1)
+			{
+				slot_base[callee] = code[ranges[r].first].m;
+				code[ranges[r].first].m += code[ranges[callee].first].m - 3;
+			}
+			site_base[i] = slot_base[callee];
+		}
+	}
+
+	inlined = compile_allocate((new_length + 1) * sizeof(instruction));
+	relocated = compile_allocate((new_length + 1) * sizeof(bool));
+	inlined_sources = compile_allocate((new_length + 1) * sizeof(int));
+	memset(relocated, 0, (new_length + 1) * sizeof(bool));
+
+	out = 0;
+	for (i = 0; i < code_index; i++)
+	{
+		position[i] = out;
+		if (callee_of[i] == -1)
+		{
+			inlined_sources[out] = code_sources[i];
+			inlined[out++] = code[i];
+			continue;
+		}
+
+		// the body runs from just after the callee's INC up to its RTN, a 
+		// jump to the RTN lands just after the copy
+		callee = callee_of[i];
+		first = ranges[callee].first + 1;
+		for (j = first; j < ranges[callee].last; j++)
+		{
+			inlined[out] = code[j];
+			inlined_sources[out] = code_sources[j];
+			if ((code[j].op == LOD || code[j].op == STO) && code[j].l == 0)
+				inlined[out].m = site_base[i] + code[j].m - 3;
+			else if (code[j].op == LOD || code[j].op == STO)
+				inlined[out].l = code[i].l + code[j].l - 1;
+			else if (code[j].op == JMP || code[j].op == JPC)
+			{
+				inlined[out].m = (position[i] + code[j].m / 3 - first) * 3;
+				relocated[out] = true;
+			}
+			out++;
+		}
+	}
+	position[code_index] = out;
+
+	for (i = 0; i < out; i++)
+		if (!relocated[i] && (inlined[i].op == JMP || inlined[i].op == JPC || inlined[i].op == CAL || 
+			inlined[i].op == TCL) && 
+			inlined[i].m / 3 >= 0 && inlined[i].m / 3 <= code_index)
+			inlined[i].m = position[inlined[i].m / 3] * 3;
+	for (i = 0; i < table_index; i++)
+		if (table[i].kind == 3 && table[i].address >= 0)
+			table[i].address = position[table[i].address / 3] * 3;
+
+	code = grow_array(code, &code_capacity, out, sizeof(instruction));
+	code_sources = grow_array(code_sources, &code_source_capacity, out, sizeof(int));
+	memcpy(code, inlined, out * sizeof(instruction));
+	memcpy(code_sources, inlined_sources, out * sizeof(int));
+	code_index = out;
+	return true;
+}
+
+// a CAL right before its procedure's RTN becomes TCL, so the callee reuses 
+// 		the frame instead of stacking a new one and deep recursion runs in 
+// 		constant stack. calls whose static link is the caller's own frame 
+// 		(L = 0, a procedure calling one nested in it) have to keep it
+void convert_tail_calls()
+{
+	int i;
+
+	for (i = 0; i + 1 < code_index; i++)
+		if (code[i].op == CAL && code[i].l > 0 && code[i + 1].op == OPR && code[i + 1].m == RTN)
+			code[i].op = TCL;
+}
+
+// keeps one copy of every procedure body that is instruction for 
+// 		instruction the same as another's once jumps are taken relative to 
+// 		the body and a call to itself counts the same in both. calls to a 
+// 		copy go to the one that stays, and since the caller still passes 
+// 		the static link the merged procedure's own callers would have, 
+// 		every non-local access reaches the same variables it did before. 
+// 		bodies are bucketed by hash and compared in full
+bool merge_procedures()
+{
+	procedure_range *ranges = compile_allocate(table_index * sizeof(procedure_range));
+	int *range_of_entry = compile_allocate((code_index + 1) * sizeof(int));
+	int *survivor = compile_allocate(table_index * sizeof(int));
+	bool *removed = compile_allocate(code_index * sizeof(bool));
+	int count = find_procedures(ranges);
+	uint32_t bucket_count = 1;
+	int *buckets;
+	uint32_t hash;
+	uint32_t b;
+	bool any_merged = false;
+	int target;
+	int r;
+	int i;
+
+	while (bucket_count < 2 * (uint32_t) count)
+		bucket_count *= 2;
+	buckets = compile_allocate(bucket_count * sizeof(int));
+	for (b = 0; b < bucket_count; b++)
+		buckets[b] = -1;
+	for (i = 0; i <= code_index; i++)
+		range_of_entry[i] = -1;
+
+	// main is the first range and ends in HLT, so it never matches
+	for (r = 0; r < count; r++)
+	{
+		range_of_entry[ranges[r].first] = r;
+		survivor[r] = r;
+		if (r == 0)
+			continue;
+		hash = procedure_body_hash(&ranges[r]);
+		for (b = hash & (bucket_count - 1); buckets[b] != -1; b = (b + 1) & (bucket_count - 1))
+			if (same_procedure_body(&ranges[buckets[b]], &ranges[r]))
 				break;
+		if (buckets[b] == -1)
+			buckets[b] = r;
+		else
+		{
+			survivor[r] = buckets[b];
+			any_merged = true;
+		}
+	}
+	if (!any_merged)
+		return false;
+
+	for (i = 0; i < code_index; i++)
+	{
+		if ((code[i].op != CAL && code[i].op != TCL) || code[i].m / 3 < 0 || code[i].m / 3 > code_index)
+			continue;
+		target = range_of_entry[code[i].m / 3];
+		if (target != -1)
+			code[i].m = ranges[survivor[target]].first * 3;
+	}
+
+	memset(removed, 0, code_index * sizeof(bool));
+	for (r = 0; r < count; r++)
+	{
+		if (survivor[r] == r)
+			continue;
+		for (i = ranges[r].first; i <= ranges[r].last; i++)
+			removed[i] = true;
+		table[ranges[r].symbol].address = -1;
+	}
+	remove_instructions(removed);
+	return true;
+}
+
+// FNV-1a over the body's instructions as same_procedure_body() sees them
+uint32_t procedure_body_hash(procedure_range *range)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = range->first; i <= range->last; i++)
+	{
+		hash = (hash ^ (uint32_t) code[i].op) * 16777619u;
+		hash = (hash ^ (uint32_t) code[i].l) * 16777619u;
+		hash = (hash ^ (uint32_t) body_operand(range, i)) * 16777619u;
+	}
+	return hash;
+}
+
+bool same_procedure_body(procedure_range *a, procedure_range *b)
+{
+	int i;
+
+	if (a->last - a->first != b->last - b->first)
+		return false;
+	for (i = 0; i <= a->last - a->first; i++)
+		if (code[a->first + i].op != code[b->first + i].op || code[a->first + i].l != code[b->first + i].l || 
+			body_operand(a, a->first + i) != body_operand(b, b->first + i))
+			return false;
+	return true;
+}
+
+// an instruction's M with jumps made relative to the start of the body and 
+// 		a call to the body itself as -1, which no other call can be
+int body_operand(procedure_range *range, int index)
+{
+	if (code[index].op == JMP || code[index].op == JPC)
+		return code[index].m - range->first * 3;
+	if ((code[index].op == CAL || code[index].op == TCL) && code[index].m == range->first * 3)
+		return -1;
+	return code[index].m;
+}
+
+// fuses LIT, RED or LOD with the STO or STG after it into SIM, RDS or CPY. 
+// 		only the first word's opcode changes, so nothing moves, and the 
+// 		store can't be a jump target since it no longer runs on its own
+void select_superinstructions()
+{
+	bool *targets = find_jump_targets();
+	int i;
+
+	for (i = 0; i + 1 < code_index; i++)
+	{
+		if ((code[i + 1].op != STO && code[i + 1].op != STG) || targets[i + 1])
+			continue;
+		if (code[i].op == LIT)
+			code[i].op = SIM;
+		else if (code[i].op == SYS && code[i].m == RED)
+			code[i].op = RDS;
+		else if (code[i].op == LOD)
+			code[i].op = CPY;
+		else
+			continue;
+		i++;
+	}
+}
+
+// fuses a relational OPR and the JPC after it into CJP, which compares and 
+// 		branches in one dispatch. the JPC is deleted, so it can't be a jump 
+// 		target, something jumping there would skip the comparison
+void fuse_compare_branches()
+{
+	bool *targets = find_jump_targets();
+	bool *removed = compile_allocate(code_index * sizeof(bool));
+	bool fused = false;
+	int i;
+
+	memset(removed, 0, code_index * sizeof(bool));
+	for (i = 0; i + 1 < code_index; i++)
+	{
+		if (code[i].op != OPR || code[i].m < EQL || code[i].m > GEQ || 
+			code[i + 1].op != JPC || targets[i + 1])
+			continue;
+		code[i].op = CJP;
+		code[i].l = code[i].m;
+		code[i].m = code[i + 1].m;
+		removed[++i] = true;
+		fused = true;
+	}
+	if (fused)
+		remove_instructions(removed);
+}
+
+// the VM's entry point for code it gets without a stack depth, the compiler 
+// 		itself goes through code_stack_depth() and the arena
+int operand_stack_depth(const instruction *code, int code_length, int *peak_at)
+{
+	int *depth = malloc((code_length + 1) * sizeof(int));
+	int *worklist = malloc((code_length + 1) * sizeof(int));
+	bool *queued = calloc(code_length + 1, sizeof(bool));
+	int deepest = -1;
+
+	if (depth != NULL && worklist != NULL && queued != NULL)
+		deepest = trace_stack_depths(code, code_length, peak_at, depth, worklist, queued);
+	free(depth);
+	free(worklist);
+	free(queued);
+	return deepest;
+}
+
+// operand_stack_depth() of the code being compiled, with its scratch space 
+// 		taken from the compile arena
+int code_stack_depth(int *peak_at)
+{
+	int *depth = compile_allocate((code_index + 1) * sizeof(int));
+	int *worklist = compile_allocate((code_index + 1) * sizeof(int));
+	bool *queued = compile_allocate((code_index + 1) * sizeof(bool));
+
+	memset(queued, 0, (code_index + 1) * sizeof(bool));
+	return trace_stack_depths(code, code_index, peak_at, depth, worklist, queued);
+}
+
+// follows every path through the code tracking how many operand cells sit 
+// 		above the current frame. INC starts a frame so the count restarts 
+// 		there, a CAL comes back with the count it left with, and where 
+// 		paths meet the deeper count wins. depth and worklist are scratch 
+// 		space for code_length + 1 entries, queued has to start out false
+int trace_stack_depths(const instruction *code, int code_length, int *peak_at, int *depth, int *worklist, 
+	bool *queued)
+{
+	int pending = 0;
+	int deepest = 0;
+	int change;
+	int after;
+	int next;
+	int i;
+
+	for (i = 0; i <= code_length; i++)
+		depth[i] = -1;
+	if (peak_at != NULL)
+		for (i = 0; i < code_length; i++)
+			peak_at[i] = 0;
+
+	// execution starts at 0 and at every procedure entry
+	for (i = 0; i < code_length; i++)
+		if ((code[i].op == CAL || code[i].op == TCL) && code[i].m / 3 >= 0 && code[i].m / 3 < code_length)
+			depth[code[i].m / 3] = 0;
+	if (code_length > 0)
+		depth[0] = 0;
+	for (i = 0; i < code_length; i++)
+		if (depth[i] == 0)
+		{
+			worklist[pending++] = i;
+			queued[i] = true;
+		}
+
+	while (pending > 0)
+	{
+		i = worklist[--pending];
+		queued[i] = false;
+
+		change = 0;
+		next = i + 1;
+		switch (code[i].op)
+		{
+			case LIT :
 			case LOD :
-				printf("LOD\t");
+			case LDG :
+				change = 1;
 				break;
 			case STO :
-				printf("STO\t");
+			case STG :
+			case JPC :
+				change = -1;
 				break;
-			case CAL :
-				printf("CAL\t");
+			case CJP :
+				change = -2;
 				break;
-			case INC :
-				printf("INC\t");
+			case OPR :
+				change = code[i].m == RTN ? 0 : -1;
+				if (code[i].m == RTN)
+					next = -1;
 				break;
-			case JMP :
-				printf("JMP\t");
+			case SYS :
+				change = code[i].m == RED ? 1 : code[i].m == WRT ? -1 : 0;
+				if (code[i].m == HLT)
+					next = -1;
 				break;
-			case JPC : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-				printf("JPC\t");
+			case INC :
+				change = -depth[i];
 				break;
-			case SYS :
-				switch (code[i].m)
-				{
-					case WRT : // DO NOT ATTEMPT TO IMPLEMENT THIS, YOU WILL GET A ZERO IF YOU DO
-						printf("WRT\t");
-						break;
-					case RED :
-						printf("RED\t");
-						break;
-					case HLT :
-						printf("HLT\t");
-						break;
-					default :
-						printf("err\t");
-						break;
-				}
+			case JMP :
+			case TCL :
+				next = -1;
 				break;
-			default :
-				printf("err\t");
+			case SIM :
+			case RDS :
+			case CPY :
+				next = i + 2;
 				break;
 		}
-		printf("%d\t%d\n", code[i].l, code[i].m);
+		after = depth[i] + change;
+		if (after < 0)
+			after = 0;
+		if (after > deepest)
+			deepest = after;
+		if (peak_at != NULL && after > peak_at[i])
+			peak_at[i] = after;
+
+		// a path that keeps pushing never settles, give up well before overflow
+		if (after > VM_STACK_SIZE)
+		{
+			deepest = -1;
+			break;
+		}
+
+		// JMP branches, JPC and CJP branch as well as falling through
+		if ((code[i].op == JMP || code[i].op == JPC || code[i].op == CJP) && code[i].m / 3 >= 0 && code[i].m / 3 < code_length && 
+			after > depth[code[i].m / 3])
+		{
+			depth[code[i].m / 3] = after;
+			if (!queued[code[i].m / 3])
+			{
+				worklist[pending++] = code[i].m / 3;
+				queued[code[i].m / 3] = true;
+			}
+		}
+		if (next >= 0 && next < code_length && after > depth[next])
+		{
+			depth[next] = after;
+			if (!queued[next])
+			{
+				worklist[pending++] = next;
+				queued[next] = true;
+			}
+		}
 	}
-	printf("\n");
+	return deepest;
 }
 
-void print_symbol_table()
+// records every procedure's frame size and operand stack depth in the table 
+// 		and the deepest of them in max_stack_depth
+void compute_stack_depths()
 {
+	procedure_range *ranges = compile_allocate(table_index * sizeof(procedure_range));
+	int *peak_at = compile_allocate((code_index + 1) * sizeof(int));
+	int count = find_procedures(ranges);
+	int r;
 	int i;
-	printf("Symbol Table:\n");
-	printf("Kind | Name        | Value | Level | Address | Mark\n");
-	printf("---------------------------------------------------\n");
-	for (i = 0; i < table_index; i++)
-		printf("%4d | %11s | %5d | %5d | %5d | %5d\n", table[i].kind, table[i].name, table[i].value, table[i].level, table[i].address, table[i].mark); 
-	printf("\n");
-}
\ No newline at end of file
+
+	max_stack_depth = code_stack_depth(peak_at);
+	for (r = 0; r < count; r++)
+	{
+		symbol *procedure = &table[ranges[r].symbol];
+		procedure->frame_size = code[ranges[r].first].op == INC ? code[ranges[r].first].m : 0;
+		procedure->stack_depth = 0;
+		for (i = ranges[r].first; i <= ranges[r].last; i++)
+			if (peak_at[i] > procedure->stack_depth)
+				procedure->stack_depth = peak_at[i];
+	}
+}
@@ -0,0 +1,327 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ARRAY_SIZE 500
+#define IDENTIFIER_LENGTH 12
+
+typedef enum token_type {
+	identifier = 1, number, keyword_const, keyword_var, keyword_procedure,
+	keyword_call, keyword_begin, keyword_end, keyword_if, keyword_then,
+	keyword_else, keyword_while, keyword_do, keyword_read, keyword_write,
+	keyword_def, period, assignment_symbol, minus, semicolon,
+	left_curly_brace, right_curly_brace, equal_to, not_equal_to, less_than,
+	less_than_or_equal_to, greater_than, greater_than_or_equal_to, plus, times,
+	division, left_parenthesis, right_parenthesis
+} token_type;
+
+// TCL only comes out of the tail call pass: it calls like CAL but the callee 
+// takes over the caller's frame, keeping its dynamic link and return address. 
+// LDG and STG address main's frame, which always starts at stack cell 0, 
+// directly by M instead of walking static links. SIM, RDS and CPY are 
+// superinstructions that replace the LIT, RED or LOD of a pair ending in STO 
+// or STG: the store stays in the next word as their destination operand and 
+// is skipped instead of executed. CJP fuses a relational OPR with the JPC 
+// after it: L is the relation (EQL to GEQ), it pops both operands and jumps 
+// to M when the relation doesn't hold
+typedef enum opcode_name {
+	LIT = 1, OPR = 2, LOD = 3, STO = 4, CAL = 5, INC = 6, JMP = 7, JPC = 8, 
+	SYS = 9, TCL = 10, LDG = 11, STG = 12, SIM = 13, RDS = 14, CPY = 15, 
+	CJP = 16, 
+	WRT = 1, RED = 2, HLT = 3, 
+	RTN = 0, ADD = 1, SUB = 2, MUL = 3, DIV = 4, EQL = 5, NEQ = 6,
+	LSS = 7, LEQ = 8, GTR = 9, GEQ = 10
+} opcode_name;
+
+// packed 8 byte token: identifiers carry their intern id in payload, numbers 
+// carry an index into the number pool, everything else leaves payload at 0
+typedef struct lexeme {
+	uint8_t type;
+	uint32_t payload;
+} lexeme;
+
+typedef struct instruction {
+	int op;
+	int l;
+	int m;
+} instruction;
+
+typedef struct symbol {
+	int kind;
+	char name[IDENTIFIER_LENGTH];
+	int value;
+	int level;
+	int address;
+	int mark;
+	int frame_size;
+	int stack_depth;
+} symbol;
+
+// lexical errors use error_code 1-5 from lexer_error_message, parser errors 
+// use the error_code and case_code pair from parser_error_message
+typedef enum diagnostic_kind {
+	lexer_diagnostic = 1, parser_diagnostic
+} diagnostic_kind;
+
+typedef struct diagnostic {
+	diagnostic_kind kind;
+	int error_code;
+	int case_code;
+	int token_index;
+} diagnostic;
+
+// source map entry for a run of instructions that came from the same place, 
+// from first_instruction up to the next entry's. the tokens are that 
+// statement's, or a procedure's whole block for its INC and RTN (and main's 
+// HLT), and procedure is the symbol of the procedure the source is written 
+// in, which inlining can make differ from the one the code ends up in. the 
+// JMP to main has no entry
+typedef struct source_span {
+	int first_instruction;
+	int first_token;
+	int last_token;
+	int procedure;
+} source_span;
+
+// what validate_lexemes() finds in one pass over a lexeme array. 
+// invalid_lexeme is the first one whose type isn't a token_type or whose 
+// identifier or number payload isn't an id or pool index this thread can 
+// look up, -1 if there is none. the balances are { minus } and begin minus 
+// end, and procedures has the tokens from each procedure keyword to its 
+// closing } (-1 if it never closes) in source order. only invalid_lexeme 
+// changes how a compile goes, the rest is for callers: the parser still 
+// checks the period, braces and begin/end itself so its diagnostics come 
+// out in the order and at the tokens they always have
+typedef struct token_range {
+	int first_token;
+	int last_token;
+} token_range;
+
+typedef struct lexeme_summary {
+	int invalid_lexeme;
+	int brace_balance;
+	int begin_balance;
+	bool ends_with_period;
+	token_range *procedures;
+	int procedure_count;
+} lexeme_summary;
+
+// everything points into the calling thread's compiler state and stays valid 
+// until that thread starts its next compilation. max_stack_depth is the most 
+// operand stack cells any procedure needs above its frame, -1 if unbounded. 
+// source_map is sorted by first_instruction
+typedef struct compile_result {
+	instruction *code;
+	int code_length;
+	int max_stack_depth;
+	symbol *table;
+	int table_length;
+	diagnostic *diagnostics;
+	int diagnostic_count;
+	source_span *source_map;
+	int source_map_length;
+	lexeme_summary lexemes;
+} compile_result;
+
+// binary code image: the magic "PAS0", then the version, the largest operand 
+// stack depth, the number of procedures and their address, frame size and 
+// stack depth, then the instruction count and op, l and m for every 
+// instruction, all little endian 32 bit integers
+#define CODE_IMAGE_MAGIC "PAS0"
+#define CODE_IMAGE_VERSION 2
+
+// relocatable object from a module: the magic "PAO0", the version, how many 
+// cells the module adds to main's frame, the instruction main's code starts 
+// at, the exports (name and instruction index of every top level procedure), 
+// the names of the procedures it calls without declaring, the relocations 
+// (instruction index, relocation_kind and the external a call names, -1 
+// otherwise), then the instruction count and code. integers are little 
+// endian 32 bit and names take IDENTIFIER_LENGTH zero padded bytes. calls to 
+// an external carry -3 * (external index + 1) until they are linked
+#define OBJECT_MAGIC "PAO0"
+#define OBJECT_VERSION 1
+
+// relocate_code moves a jump or call target with the module's code, 
+// relocate_external points a call at an export and relocate_global moves an 
+// access to main's frame to the module's share of it
+typedef enum relocation_kind {
+	relocate_code = 0, relocate_external, relocate_global
+} relocation_kind;
+
+// server mode framing: a request is a 4 byte big endian length followed by a 
+// flags byte and the input. a response is a 4 byte big endian length followed 
+// by a status byte (0 ok, 1 errors) and the listing, code image or errors
+#define REQUEST_SOURCE 1
+#define REQUEST_BINARY 2
+
+// counters for a thread's compiler arena, malloc_calls stops moving once the 
+// arena has grown to fit the largest compilation it has seen
+typedef struct allocation_stats {
+	long allocations;
+	long malloc_calls;
+	long resets;
+	long bytes_reserved;
+	long high_water;
+} allocation_stats;
+
+// phase tracing. after start_tracing() every thread that compiles records 
+// begin and end events for program(), block(), procedures(), lowering and 
+// the output writers in a buffer of TRACE_EVENTS it allocates once, later 
+// events are dropped. call it before any thread compiles, write_trace() 
+// prints what every thread recorded as Chrome trace event JSON
+#define TRACE_EVENTS (1 << 16)
+
+// library interface, each thread compiles independently. identifier ids come 
+// from one lock free table the whole process shares, so they can be interned 
+// on any thread and mean the same name everywhere. compile_lexemes() checks 
+// its input with validate_lexemes() first and turns an invalid lexeme into 
+// a lexical error instead of parsing it
+void begin_compilation(void);
+uint32_t intern_identifier(char name[]);
+char *identifier_name(uint32_t id);
+uint32_t pool_number(int value);
+bool validate_lexemes(const lexeme *input, int count, lexeme_summary *summary);
+int compile_lexemes(const lexeme *input, int count, compile_result *result);
+int compile_token_text(const char *text, int length, compile_result *result);
+int compile_source(const char *source, int length, compile_result *result);
+const char *diagnostic_message(const diagnostic *entry);
+int find_source_span(const source_span *map, int length, int instruction);
+void release_compiler_state(void);
+void get_allocation_stats(allocation_stats *stats);
+void start_tracing(void);
+void write_trace(FILE *ofp);
+
+// optional passes over the code of a successful compilation, set per thread 
+// with set_optimizations(). none run by default so the listing matches the 
+// reference output. eliminated or merged procedures and variables keep 
+// address -1
+typedef enum optimization {
+	optimize_dead_procedures = 1 << 0,
+	optimize_frames = 1 << 1,
+	optimize_inline = 1 << 2,
+	optimize_tail_calls = 1 << 3,
+	optimize_global_addressing = 1 << 4,
+	optimize_superinstructions = 1 << 5,
+	optimize_merge_procedures = 1 << 6,
+	optimize_branches = 1 << 7,
+	optimize_expressions = 1 << 8,
+	optimize_all = (1 << 9) - 1
+} optimization;
+
+// procedures whose body is at most this many instructions get inlined
+#define DEFAULT_INLINE_LIMIT 8
+
+void set_optimizations(int flags);
+void set_inline_limit(int instructions);
+
+// separate compilation. in module mode a call to a procedure the input 
+// doesn't declare becomes an external for the linker instead of an error, 
+// and dead procedure elimination is skipped since other modules may call 
+// anything. write_object() writes the last successful compilation
+void set_module_mode(bool enabled);
+void write_object(FILE *ofp);
+
+// linker (linker.c): lays out the procedures of every object in order, then 
+// main from the one object whose main has statements, points each external 
+// call at the export of that name and gives every module its own part of 
+// main's frame. result->code is malloced, result->symbol names the 
+// procedure a duplicate or unresolved error is about
+typedef enum link_status {
+	link_ok = 0, link_bad_object, link_duplicate_symbol, link_unresolved_symbol, 
+	link_no_main, link_multiple_mains, link_out_of_memory
+} link_status;
+
+typedef struct link_result {
+	instruction *code;
+	int code_length;
+	char symbol[IDENTIFIER_LENGTH];
+} link_result;
+
+link_status link_objects(const unsigned char *const *objects, const long *lengths, int count, 
+	link_result *result);
+const char *link_status_message(link_status status);
+
+// most operand stack cells any procedure in code pushes above its frame, -1 
+// if some path keeps growing the stack. peak_at, if not NULL, gets the depth 
+// each instruction can reach
+int operand_stack_depth(const instruction *code, int code_length, int *peak_at);
+
+// virtual machine (vm.c). the stack holds VM_STACK_SIZE cells, each 
+// activation record starts with the static link, dynamic link and return 
+// address, and code addresses are instruction indexes times 3 (PAS format). 
+// stack_depth is the compiler's max_stack_depth, frames are checked against 
+// the stack size when they are pushed and operand pushes aren't checked at 
+// all. a negative stack_depth makes the VM compute it
+#define VM_STACK_SIZE (1 << 20)
+
+typedef struct vm_io {
+	int (*read)(void *context);
+	void (*write)(void *context, int value);
+	void *context;
+} vm_io;
+
+// vm_yielded means a resumable instance stopped early and isn't finished
+typedef enum vm_status {
+	vm_halted = 0, vm_stack_overflow, vm_division_by_zero, vm_bad_instruction, 
+	vm_unsupported, vm_yielded
+} vm_status;
+
+// executed is set by the caller, NULL or an array of code_length counters 
+// that get how many times each instruction ran
+typedef struct vm_stats {
+	long instructions;
+	long calls;
+	long *executed;
+} vm_stats;
+
+// a program part way through running. frames have to end below stack_limit, 
+// which grows on demand, and stack_depth more cells are kept for operands
+typedef struct vm_instance {
+	const instruction *code;
+	int code_length;
+	int stack_depth;
+	int stack_limit;
+	int *stack;
+	int bp;
+	int sp;
+	int pc;
+	bool yield_on_io;
+	vm_io *io;
+	vm_stats *stats;
+} vm_instance;
+
+vm_status run_program(const instruction *code, int code_length, int stack_depth, vm_io *io, vm_stats *stats);
+vm_status jit_run_program(const instruction *code, int code_length, int stack_depth, vm_io *io);
+vm_status start_program(vm_instance *instance, const instruction *code, int code_length, int stack_depth, 
+	int initial_cells, vm_io *io, vm_stats *stats);
+vm_status resume_program(vm_instance *instance, long fuel);
+void finish_program(vm_instance *instance);
+const char *vm_status_message(vm_status status);
+
+// batch execution, one program over many independent records. VM_LANES 
+// records at a time step through the code together with each stack cell 
+// holding all their values in one SIMD vector. once a JPC sends them 
+// different ways, or a DIV would divide by zero in only some of them, each 
+// record finishes alone in the interpreter
+#define VM_LANES 8
+
+void run_program_batch(const instruction *code, int code_length, int stack_depth, int count, 
+	vm_io *io, vm_status *status);
+
+// cooperative runtime (scheduler.c): many programs share a fixed pool of 
+// worker threads. each runs for at most fuel instructions at a time and also 
+// yields after every RED and WRT, a worker with nothing left to run steals 
+// from the others. a program's status goes to *status once it finishes. 
+// create_scheduler() returns NULL if it can't allocate or start its workers
+typedef struct vm_scheduler vm_scheduler;
+
+vm_scheduler *create_scheduler(int workers, long fuel);
+bool schedule_program(vm_scheduler *scheduler, const instruction *code, int code_length, int stack_depth, 
+	vm_io *io, vm_status *status);
+void wait_for_programs(vm_scheduler *scheduler);
+void destroy_scheduler(vm_scheduler *scheduler);
+
+#endif
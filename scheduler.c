@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "parser.h"
+
+// programs start with this many stack cells and grow when they need more, 
+// so thousands of small ones don't each hold a VM_STACK_SIZE stack
+#define TASK_STACK_CELLS 1024
+
+// one scheduled program
+typedef struct vm_task {
+	vm_instance instance;
+	vm_status *status;
+} vm_task;
+
+// a worker's run queue, a ring buffer. the worker takes from the front and 
+// puts yielded tasks back at the end so its programs take turns, thieves 
+// take from the end
+typedef struct task_queue {
+	pthread_mutex_t lock;
+	vm_task **tasks;
+	int capacity;
+	int head;
+	int count;
+} task_queue;
+
+typedef struct worker {
+	vm_scheduler *scheduler;
+	task_queue queue;
+	pthread_t thread;
+	int index;
+	unsigned seed;
+} worker;
+
+// queued and sleeping are checked without the lock, a worker only goes to 
+// sleep after seeing queued at 0 with sleeping raised, and whoever queues a 
+// task wakes a sleeper if it sees one, so no task gets stranded
+struct vm_scheduler {
+	worker *workers;
+	int worker_count;
+	long fuel;
+	atomic_int next_worker;
+	atomic_long queued;
+	atomic_int sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t work_available;
+	pthread_cond_t all_done;
+	long unfinished;
+	bool shutting_down;
+};
+
+void *run_worker(void *argument);
+vm_task *next_task(worker *self);
+void queue_task(vm_scheduler *scheduler, task_queue *queue, vm_task *task);
+void queue_init(task_queue *queue);
+void queue_destroy(task_queue *queue);
+bool queue_push_back(task_queue *queue, vm_task *task);
+vm_task *queue_pop_front(task_queue *queue);
+vm_task *queue_pop_back(task_queue *queue);
+
+// starts workers threads, each running a program for at most fuel 
+// 		instructions before moving on to the next one. NULL if the memory 
+// 		or the threads can't be had
+vm_scheduler *create_scheduler(int workers, long fuel)
+{
+	vm_scheduler *scheduler = calloc(1, sizeof(vm_scheduler));
+	int i;
+	int k;
+
+	if (scheduler == NULL)
+		return NULL;
+	if (workers < 1)
+		workers = 1;
+	scheduler->workers = calloc(workers, sizeof(worker));
+	if (scheduler->workers == NULL)
+	{
+		free(scheduler);
+		return NULL;
+	}
+	scheduler->worker_count = workers;
+	scheduler->fuel = fuel > 0 ? fuel : 1;
+	atomic_init(&scheduler->next_worker, 0);
+	atomic_init(&scheduler->queued, 0);
+	atomic_init(&scheduler->sleeping, 0);
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->work_available, NULL);
+	pthread_cond_init(&scheduler->all_done, NULL);
+
+	for (i = 0; i < workers; i++)
+	{
+		scheduler->workers[i].scheduler = scheduler;
+		scheduler->workers[i].index = i;
+		scheduler->workers[i].seed = i * 2654435761u + 1;
+		queue_init(&scheduler->workers[i].queue);
+	}
+	for (i = 0; i < workers; i++)
+		if (pthread_create(&scheduler->workers[i].thread, NULL, run_worker, &scheduler->workers[i]) != 0)
+		{
+			// nothing is queued yet, so the workers that did start just stop
+			for (k = i; k < workers; k++)
+				queue_destroy(&scheduler->workers[k].queue);
+			scheduler->worker_count = i;
+			destroy_scheduler(scheduler);
+			return NULL;
+		}
+	return scheduler;
+}
+
+// hands a program to the workers, new programs are spread round robin. 
+// 		returns false, with the reason in *status, if it couldn't start
+bool schedule_program(vm_scheduler *scheduler, const instruction *code, int code_length, int stack_depth, 
+	vm_io *io, vm_status *status)
+{
+	vm_task *task = malloc(sizeof(vm_task));
+	int target;
+
+	if (task == NULL)
+	{
+		*status = vm_stack_overflow;
+		return false;
+	}
+	*status = start_program(&task->instance, code, code_length, stack_depth, TASK_STACK_CELLS, io, NULL);
+	if (*status != vm_yielded)
+	{
+		free(task);
+		return false;
+	}
+	task->instance.yield_on_io = true;
+	task->status = status;
+
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->unfinished++;
+	pthread_mutex_unlock(&scheduler->lock);
+
+	target = (unsigned) atomic_fetch_add(&scheduler->next_worker, 1) % scheduler->worker_count;
+	queue_task(scheduler, &scheduler->workers[target].queue, task);
+	return true;
+}
+
+// blocks until every scheduled program has finished
+void wait_for_programs(vm_scheduler *scheduler)
+{
+	pthread_mutex_lock(&scheduler->lock);
+	while (scheduler->unfinished > 0)
+		pthread_cond_wait(&scheduler->all_done, &scheduler->lock);
+	pthread_mutex_unlock(&scheduler->lock);
+}
+
+// waits for the scheduled programs, then stops the workers and frees everything
+void destroy_scheduler(vm_scheduler *scheduler)
+{
+	int i;
+
+	wait_for_programs(scheduler);
+	pthread_mutex_lock(&scheduler->lock);
+	scheduler->shutting_down = true;
+	pthread_cond_broadcast(&scheduler->work_available);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	for (i = 0; i < scheduler->worker_count; i++)
+		pthread_join(scheduler->workers[i].thread, NULL);
+	for (i = 0; i < scheduler->worker_count; i++)
+		queue_destroy(&scheduler->workers[i].queue);
+	pthread_mutex_destroy(&scheduler->lock);
+	pthread_cond_destroy(&scheduler->work_available);
+	pthread_cond_destroy(&scheduler->all_done);
+	free(scheduler->workers);
+	free(scheduler);
+}
+
+// a worker runs one slice of a task at a time, a task that yields goes back 
+// 		on the worker's own queue and a finished one reports its status
+void *run_worker(void *argument)
+{
+	worker *self = argument;
+	vm_scheduler *scheduler = self->scheduler;
+	vm_task *task;
+	vm_status status;
+
+	while (1)
+	{
+		task = next_task(self);
+		if (task == NULL)
+		{
+			// nothing anywhere, sleep until something gets queued
+			pthread_mutex_lock(&scheduler->lock);
+			atomic_fetch_add(&scheduler->sleeping, 1);
+			while (atomic_load(&scheduler->queued) == 0 && !scheduler->shutting_down)
+				pthread_cond_wait(&scheduler->work_available, &scheduler->lock);
+			atomic_fetch_sub(&scheduler->sleeping, 1);
+			if (scheduler->shutting_down && atomic_load(&scheduler->queued) == 0)
+			{
+				pthread_mutex_unlock(&scheduler->lock);
+				return NULL;
+			}
+			pthread_mutex_unlock(&scheduler->lock);
+			continue;
+		}
+
+		status = resume_program(&task->instance, scheduler->fuel);
+		if (status == vm_yielded)
+		{
+			queue_task(scheduler, &self->queue, task);
+			continue;
+		}
+
+		*task->status = status;
+		finish_program(&task->instance);
+		free(task);
+		pthread_mutex_lock(&scheduler->lock);
+		if (--scheduler->unfinished == 0)
+			pthread_cond_broadcast(&scheduler->all_done);
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+}
+
+// the worker's own queue first, then the other workers' starting from a 
+// 		random one so thieves spread out
+vm_task *next_task(worker *self)
+{
+	vm_scheduler *scheduler = self->scheduler;
+	vm_task *task = queue_pop_front(&self->queue);
+	int start;
+	int i;
+
+	if (task == NULL && scheduler->worker_count > 1)
+	{
+		self->seed = self->seed * 1103515245 + 12345;
+		start = (self->seed >> 16) % scheduler->worker_count;
+		for (i = 0; i < scheduler->worker_count && task == NULL; i++)
+			if ((start + i) % scheduler->worker_count != self->index)
+				task = queue_pop_back(&scheduler->workers[(start + i) % scheduler->worker_count].queue);
+	}
+	if (task != NULL)
+		atomic_fetch_sub(&scheduler->queued, 1);
+	return task;
+}
+
+// puts a task on a queue and wakes a sleeping worker if there is one
+void queue_task(vm_scheduler *scheduler, task_queue *queue, vm_task *task)
+{
+	if (!queue_push_back(queue, task))
+	{
+		// out of memory growing the queue, the program can't continue
+		*task->status = vm_stack_overflow;
+		finish_program(&task->instance);
+		free(task);
+		pthread_mutex_lock(&scheduler->lock);
+		if (--scheduler->unfinished == 0)
+			pthread_cond_broadcast(&scheduler->all_done);
+		pthread_mutex_unlock(&scheduler->lock);
+		return;
+	}
+	atomic_fetch_add(&scheduler->queued, 1);
+	if (atomic_load(&scheduler->sleeping) > 0)
+	{
+		pthread_mutex_lock(&scheduler->lock);
+		pthread_cond_signal(&scheduler->work_available);
+		pthread_mutex_unlock(&scheduler->lock);
+	}
+}
+
+void queue_init(task_queue *queue)
+{
+	pthread_mutex_init(&queue->lock, NULL);
+	queue->tasks = NULL;
+	queue->capacity = 0;
+	queue->head = 0;
+	queue->count = 0;
+}
+
+void queue_destroy(task_queue *queue)
+{
+	pthread_mutex_destroy(&queue->lock);
+	free(queue->tasks);
+}
+
+// adds a task at the end, doubling the ring when it is full
+bool queue_push_back(task_queue *queue, vm_task *task)
+{
+	vm_task **tasks;
+	int capacity;
+	int i;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->capacity)
+	{
+		capacity = queue->capacity > 0 ? queue->capacity * 2 : 64;
+		tasks = malloc(capacity * sizeof(vm_task *));
+		if (tasks == NULL)
+		{
+			pthread_mutex_unlock(&queue->lock);
+			return false;
+		}
+		for (i = 0; i < queue->count; i++)
+			tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+		free(queue->tasks);
+		queue->tasks = tasks;
+		queue->capacity = capacity;
+		queue->head = 0;
+	}
+	queue->tasks[(queue->head + queue->count) % queue->capacity] = task;
+	queue->count++;
+	pthread_mutex_unlock(&queue->lock);
+	return true;
+}
+
+vm_task *queue_pop_front(task_queue *queue)
+{
+	vm_task *task = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count > 0)
+	{
+		task = queue->tasks[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return task;
+}
+
+vm_task *queue_pop_back(task_queue *queue)
+{
+	vm_task *task = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count > 0)
+	{
+		queue->count--;
+		task = queue->tasks[(queue->head + queue->count) % queue->capacity];
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return task;
+}
@@ -0,0 +1,1284 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parser.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#define JIT_AVAILABLE 1
+#endif
+
+// interpreter
+int base(int *stack, int bp, int l);
+bool grow_stack(vm_instance *instance, int top);
+int store_address(int *stack, int bp, const instruction *store);
+
+// batches, lanes live side by side in GCC vector types so every cell is one 
+// SIMD register wide
+#if defined(__GNUC__)
+#define LANES_AVAILABLE 1
+
+typedef int lane_vector __attribute__((vector_size(VM_LANES * sizeof(int))));
+typedef unsigned lane_unsigned __attribute__((vector_size(VM_LANES * sizeof(unsigned))));
+
+// every lane set to value, a macro since vectors wider than the target's 
+// registers can't be passed by value without an ABI warning
+#define LANE_BROADCAST(value) ((lane_vector) { 0 } + (value))
+
+// the shared stack, reused from one batch of lanes to the next. cells past 
+// peak + stack_depth have never been written and are still zero
+typedef struct lane_batch {
+	const instruction *code;
+	int code_length;
+	int stack_depth;
+	int stack_limit;
+	int peak;
+	lane_vector *stack;
+} lane_batch;
+
+void run_lanes(lane_batch *batch, vm_io *io, vm_status *status);
+void split_lanes(lane_batch *batch, int bp, int sp, int pc, vm_io *io, vm_status *status);
+bool grow_lanes(lane_batch *batch, int top);
+int lane_zero_count(const lane_vector *value);
+int lane_base(lane_vector *stack, int bp, int l);
+#endif
+
+// jit
+typedef struct jit_context {
+	vm_io *io;
+	long limit;
+} jit_context;
+
+typedef struct jit_buffer {
+	unsigned char *bytes;
+	int length;
+} jit_buffer;
+
+typedef struct jit_fixup {
+	int position;
+	int target;
+} jit_fixup;
+
+int jit_read(jit_context *context);
+void jit_write(jit_context *context, int value);
+void jit_byte(jit_buffer *buffer, int value);
+void jit_bytes(jit_buffer *buffer, const char *bytes, int count);
+void jit_int32(jit_buffer *buffer, int value);
+void jit_int64(jit_buffer *buffer, int64_t value);
+void jit_base(jit_buffer *buffer, int l);
+void jit_operand_address(jit_buffer *buffer, int l, int opcode_prefix, int reg, int m);
+int jit_frame_distance(const instruction *ir);
+bool jit_binary_operation(jit_buffer *buffer, int operation, jit_fixup *fixups, int *fixup_count);
+int jit_power_of_two(int value);
+void jit_shift_operation(jit_buffer *buffer, int operation, int shift);
+
+// walks l static links down from bp
+int base(int *stack, int bp, int l)
+{
+	int arb = bp;
+	while (l > 0)
+	{
+		arb = stack[arb];
+		l--;
+	}
+	return arb;
+}
+
+// the cell a STO or STG writes, used for a superinstruction's operand word
+int store_address(int *stack, int bp, const instruction *store)
+{
+	return store->op == STG ? store->m : base(stack, bp, store->l) + store->m;
+}
+
+// reference interpreter, runs the program to completion in one go
+vm_status run_program(const instruction *code, int code_length, int stack_depth, vm_io *io, vm_stats *stats)
+{
+	vm_instance instance;
+	vm_status status = start_program(&instance, code, code_length, stack_depth, VM_STACK_SIZE, io, stats);
+
+	if (status != vm_yielded)
+		return status;
+	status = resume_program(&instance, -1);
+	finish_program(&instance);
+	return status;
+}
+
+// sets up an instance to run code from the start with a stack of 
+// 		initial_cells that grows on demand up to VM_STACK_SIZE. returns 
+// 		vm_yielded when it is ready to resume, anything else is an error
+vm_status start_program(vm_instance *instance, const instruction *code, int code_length, int stack_depth, 
+	int initial_cells, vm_io *io, vm_stats *stats)
+{
+	if (stats != NULL)
+	{
+		stats->instructions = 0;
+		stats->calls = 0;
+		if (stats->executed != NULL)
+			memset(stats->executed, 0, code_length * sizeof(long));
+	}
+	if (stack_depth < 0)
+		stack_depth = operand_stack_depth(code, code_length, NULL);
+	if (stack_depth < 0)
+		return vm_bad_instruction;
+	if (initial_cells > VM_STACK_SIZE)
+		initial_cells = VM_STACK_SIZE;
+
+	instance->code = code;
+	instance->code_length = code_length;
+	instance->stack_depth = stack_depth;
+	instance->stack_limit = initial_cells;
+	instance->stack = calloc(initial_cells + stack_depth + 1, sizeof(int));
+	instance->bp = 0;
+	instance->sp = -1;
+	instance->pc = 0;
+	instance->yield_on_io = false;
+	instance->io = io;
+	instance->stats = stats;
+	return instance->stack == NULL ? vm_stack_overflow : vm_yielded;
+}
+
+// makes room for frames up to cell top, doubling the stack until it fits 
+// 		or would pass VM_STACK_SIZE
+bool grow_stack(vm_instance *instance, int top)
+{
+	int limit = instance->stack_limit;
+	int *stack;
+
+	if (top >= VM_STACK_SIZE)
+		return false;
+	while (limit <= top)
+		limit = limit * 2 > VM_STACK_SIZE ? VM_STACK_SIZE : limit * 2;
+	stack = realloc(instance->stack, (limit + instance->stack_depth + 1) * sizeof(int));
+	if (stack == NULL)
+		return false;
+	memset(stack + instance->stack_limit + instance->stack_depth + 1, 0, 
+		(limit - instance->stack_limit) * sizeof(int));
+	instance->stack = stack;
+	instance->stack_limit = limit;
+	return true;
+}
+
+// runs at most fuel instructions (no limit if fuel is negative) and returns 
+// 		vm_yielded if the program stopped early and can be resumed. with 
+// 		yield_on_io set it also stops after every RED and WRT. frames are 
+// 		bounds checked when CAL and INC push them, operand pushes can't 
+// 		run past the stack_depth cells kept above the limit so they go 
+// 		unchecked
+vm_status resume_program(vm_instance *instance, long fuel)
+{
+	const instruction *code = instance->code;
+	int code_length = instance->code_length;
+	int *stack = instance->stack;
+	int bp = instance->bp;
+	int sp = instance->sp;
+	int pc = instance->pc;
+	vm_io *io = instance->io;
+	vm_stats *stats = instance->stats;
+	int a;
+	int b;
+	vm_status status = vm_halted;
+	const instruction *ir;
+
+	while (1)
+	{
+		if (fuel >= 0 && fuel-- == 0)
+		{
+			status = vm_yielded;
+			break;
+		}
+
+		// fetch
+		if (pc < 0 || pc / 3 >= code_length)
+		{
+			status = vm_bad_instruction;
+			break;
+		}
+		ir = &code[pc / 3];
+		pc += 3;
+		if (stats != NULL)
+		{
+			stats->instructions++;
+			if (stats->executed != NULL)
+				stats->executed[ir - code]++;
+		}
+
+		// execute
+		switch (ir->op)
+		{
+			case LIT :
+				stack[++sp] = ir->m;
+				break;
+			case OPR :
+				if (ir->m == RTN)
+				{
+					sp = bp - 1;
+					bp = stack[sp + 2];
+					pc = stack[sp + 3];
+					break;
+				}
+				b = stack[sp--];
+				a = stack[sp];
+				switch (ir->m)
+				{
+					// overflow wraps around, the same way the compiler folds constants
+					case ADD : a = (int) ((unsigned) a + (unsigned) b); break;
+					case SUB : a = (int) ((unsigned) a - (unsigned) b); break;
+					case MUL : a = (int) ((unsigned) a * (unsigned) b); break;
+					case DIV :
+						if (b == 0)
+						{
+							status = vm_division_by_zero;
+							goto done;
+						}
+						// INT_MIN / -1 would trap, negating wraps it to INT_MIN
+						a = b == -1 ? (int) (0u - (unsigned) a) : a / b;
+						break;
+					case EQL : a = a == b; break;
+					case NEQ : a = a != b; break;
+					case LSS : a = a < b; break;
+					case LEQ : a = a <= b; break;
+					case GTR : a = a > b; break;
+					case GEQ : a = a >= b; break;
+					default :
+						status = vm_bad_instruction;
+						goto done;
+				}
+				stack[sp] = a;
+				break;
+			case LOD :
+				a = stack[base(stack, bp, ir->l) + ir->m];
+				stack[++sp] = a;
+				break;
+			case STO :
+				stack[base(stack, bp, ir->l) + ir->m] = stack[sp--];
+				break;
+			case LDG :
+				a = stack[ir->m];
+				stack[++sp] = a;
+				break;
+			case STG :
+				stack[ir->m] = stack[sp--];
+				break;
+			case SIM :
+			case RDS :
+			case CPY :
+				// the destination store is the next word, skipped over here
+				if (pc / 3 >= code_length)
+				{
+					status = vm_bad_instruction;
+					goto done;
+				}
+				if (ir->op == SIM)
+					a = ir->m;
+				else if (ir->op == RDS)
+					a = io->read(io->context);
+				else
+					a = stack[base(stack, bp, ir->l) + ir->m];
+				stack[store_address(stack, bp, &code[pc / 3])] = a;
+				pc += 3;
+				if (ir->op == RDS && instance->yield_on_io)
+				{
+					status = vm_yielded;
+					goto done;
+				}
+				break;
+			case CAL :
+				if (sp + 3 >= instance->stack_limit)
+				{
+					if (!grow_stack(instance, sp + 3))
+					{
+						status = vm_stack_overflow;
+						goto done;
+					}
+					stack = instance->stack;
+				}
+				stack[sp + 1] = base(stack, bp, ir->l);
+				stack[sp + 2] = bp;
+				stack[sp + 3] = pc;
+				bp = sp + 1;
+				pc = ir->m;
+				if (stats != NULL)
+					stats->calls++;
+				break;
+			case TCL :
+				// the callee takes over this frame, only its static link changes
+				stack[bp] = base(stack, bp, ir->l);
+				sp = bp - 1;
+				pc = ir->m;
+				if (stats != NULL)
+					stats->calls++;
+				break;
+			case INC :
+				if (sp + ir->m >= instance->stack_limit)
+				{
+					if (!grow_stack(instance, sp + ir->m))
+					{
+						status = vm_stack_overflow;
+						goto done;
+					}
+					stack = instance->stack;
+				}
+				sp += ir->m;
+				break;
+			case JMP :
+				pc = ir->m;
+				break;
+			case JPC :
+				if (stack[sp--] == 0)
+					pc = ir->m;
+				break;
+			case CJP :
+				b = stack[sp--];
+				a = stack[sp--];
+				switch (ir->l)
+				{
+					case EQL : a = a == b; break;
+					case NEQ : a = a != b; break;
+					case LSS : a = a < b; break;
+					case LEQ : a = a <= b; break;
+					case GTR : a = a > b; break;
+					case GEQ : a = a >= b; break;
+					default :
+						status = vm_bad_instruction;
+						goto done;
+				}
+				if (!a)
+					pc = ir->m;
+				break;
+			case SYS :
+				switch (ir->m)
+				{
+					case WRT :
+						io->write(io->context, stack[sp--]);
+						break;
+					case RED :
+						stack[++sp] = io->read(io->context);
+						break;
+					case HLT :
+						goto done;
+					default :
+						status = vm_bad_instruction;
+						goto done;
+				}
+				if (instance->yield_on_io)
+				{
+					status = vm_yielded;
+					goto done;
+				}
+				break;
+			default :
+				status = vm_bad_instruction;
+				goto done;
+		}
+	}
+
+done:
+	instance->bp = bp;
+	instance->sp = sp;
+	instance->pc = pc;
+	return status;
+}
+
+// frees an instance's stack, it can't be resumed afterwards
+void finish_program(vm_instance *instance)
+{
+	free(instance->stack);
+	instance->stack = NULL;
+}
+
+// runs code once for each of count records, record i reading and writing 
+// 		through io[i] and finishing with status[i]. full batches of VM_LANES 
+// 		records run together, the rest one at a time
+void run_program_batch(const instruction *code, int code_length, int stack_depth, int count, 
+	vm_io *io, vm_status *status)
+{
+	int first = 0;
+	int i;
+
+	if (stack_depth < 0)
+		stack_depth = operand_stack_depth(code, code_length, NULL);
+	if (stack_depth < 0)
+	{
+		for (i = 0; i < count; i++)
+			status[i] = vm_bad_instruction;
+		return;
+	}
+
+#ifdef LANES_AVAILABLE
+	lane_batch batch;
+
+	batch.code = code;
+	batch.code_length = code_length;
+	batch.stack_depth = stack_depth;
+	batch.stack_limit = 1024;
+	batch.peak = -1;
+	batch.stack = aligned_alloc(sizeof(lane_vector), (batch.stack_limit + stack_depth + 1) * sizeof(lane_vector));
+	if (batch.stack != NULL)
+	{
+		memset(batch.stack, 0, (batch.stack_limit + stack_depth + 1) * sizeof(lane_vector));
+		for (; first + VM_LANES <= count; first += VM_LANES)
+		{
+			run_lanes(&batch, io + first, status + first);
+			memset(batch.stack, 0, (batch.peak + stack_depth + 1) * sizeof(lane_vector));
+			batch.peak = -1;
+		}
+		free(batch.stack);
+	}
+#endif
+
+	for (i = first; i < count; i++)
+		status[i] = run_program(code, code_length, stack_depth, &io[i], NULL);
+}
+
+#ifdef LANES_AVAILABLE
+// runs VM_LANES records in lockstep. while they take the same path their 
+// 		frames sit at the same cells, so one bp, sp and pc serve them all and 
+// 		links and return addresses are read from lane 0. a JPC or CJP the 
+// 		lanes disagree on, or a DIV by zero in some of them, hands every lane to 
+// 		split_lanes() right before that instruction
+void run_lanes(lane_batch *batch, vm_io *io, vm_status *status)
+{
+	const instruction *code = batch->code;
+	int code_length = batch->code_length;
+	lane_vector *stack = batch->stack;
+	int bp = 0;
+	int sp = -1;
+	int pc = 0;
+	int peak = -1;
+	int address;
+	int zeros;
+	int i;
+	lane_vector a;
+	lane_vector b;
+	lane_vector overflow;
+	vm_status result = vm_halted;
+	const instruction *ir;
+
+	while (1)
+	{
+		// fetch
+		if (pc < 0 || pc / 3 >= code_length)
+		{
+			result = vm_bad_instruction;
+			break;
+		}
+		ir = &code[pc / 3];
+		pc += 3;
+
+		// execute
+		switch (ir->op)
+		{
+			case LIT :
+				stack[++sp] = LANE_BROADCAST(ir->m);
+				break;
+			case OPR :
+				if (ir->m == RTN)
+				{
+					sp = bp - 1;
+					bp = stack[sp + 2][0];
+					pc = stack[sp + 3][0];
+					break;
+				}
+				b = stack[sp];
+				if (ir->m == DIV && lane_zero_count(&b) != 0)
+				{
+					batch->peak = peak;
+					split_lanes(batch, bp, sp, pc - 3, io, status);
+					return;
+				}
+				a = stack[--sp];
+				switch (ir->m)
+				{
+					case ADD : a = (lane_vector) ((lane_unsigned) a + (lane_unsigned) b); break;
+					case SUB : a = (lane_vector) ((lane_unsigned) a - (lane_unsigned) b); break;
+					case MUL : a = (lane_vector) ((lane_unsigned) a * (lane_unsigned) b); break;
+					// lanes dividing by -1 divide by 1 and are negated instead
+					case DIV :
+						overflow = b == -1;
+						a = a / (b + (overflow & 2));
+						a = (lane_vector) (((lane_unsigned) a ^ (lane_unsigned) overflow) - (lane_unsigned) overflow);
+						break;
+					// vector comparisons give -1 for true
+					case EQL : a = (a == b) & 1; break;
+					case NEQ : a = (a != b) & 1; break;
+					case LSS : a = (a < b) & 1; break;
+					case LEQ : a = (a <= b) & 1; break;
+					case GTR : a = (a > b) & 1; break;
+					case GEQ : a = (a >= b) & 1; break;
+					default :
+						result = vm_bad_instruction;
+						goto done;
+				}
+				stack[sp] = a;
+				break;
+			case LOD :
+				a = stack[lane_base(stack, bp, ir->l) + ir->m];
+				stack[++sp] = a;
+				break;
+			case STO :
+				stack[lane_base(stack, bp, ir->l) + ir->m] = stack[sp--];
+				break;
+			case LDG :
+				a = stack[ir->m];
+				stack[++sp] = a;
+				break;
+			case STG :
+				stack[ir->m] = stack[sp--];
+				break;
+			case SIM :
+			case RDS :
+			case CPY :
+				if (pc / 3 >= code_length)
+				{
+					result = vm_bad_instruction;
+					goto done;
+				}
+				if (ir->op == SIM)
+					a = LANE_BROADCAST(ir->m);
+				else if (ir->op == CPY)
+					a = stack[lane_base(stack, bp, ir->l) + ir->m];
+				else
+					for (i = 0; i < VM_LANES; i++)
+						a[i] = io[i].read(io[i].context);
+				address = code[pc / 3].op == STG ? code[pc / 3].m 
+					: lane_base(stack, bp, code[pc / 3].l) + code[pc / 3].m;
+				stack[address] = a;
+				pc += 3;
+				break;
+			case CAL :
+				if (sp + 3 >= batch->stack_limit)
+				{
+					if (!grow_lanes(batch, sp + 3))
+					{
+						result = vm_stack_overflow;
+						goto done;
+					}
+					stack = batch->stack;
+				}
+				stack[sp + 1] = LANE_BROADCAST(lane_base(stack, bp, ir->l));
+				stack[sp + 2] = LANE_BROADCAST(bp);
+				stack[sp + 3] = LANE_BROADCAST(pc);
+				bp = sp + 1;
+				pc = ir->m;
+				if (sp + 3 > peak)
+					peak = sp + 3;
+				break;
+			case TCL :
+				stack[bp] = LANE_BROADCAST(lane_base(stack, bp, ir->l));
+				sp = bp - 1;
+				pc = ir->m;
+				break;
+			case INC :
+				if (sp + ir->m >= batch->stack_limit)
+				{
+					if (!grow_lanes(batch, sp + ir->m))
+					{
+						result = vm_stack_overflow;
+						goto done;
+					}
+					stack = batch->stack;
+				}
+				sp += ir->m;
+				if (sp > peak)
+					peak = sp;
+				break;
+			case JMP :
+				pc = ir->m;
+				break;
+			case JPC :
+				zeros = lane_zero_count(&stack[sp]);
+				if (zeros != 0 && zeros != VM_LANES)
+				{
+					batch->peak = peak;
+					split_lanes(batch, bp, sp, pc - 3, io, status);
+					return;
+				}
+				sp--;
+				if (zeros == VM_LANES)
+					pc = ir->m;
+				break;
+			case CJP :
+				a = stack[sp - 1];
+				b = stack[sp];
+				switch (ir->l)
+				{
+					case EQL : a = (a == b) & 1; break;
+					case NEQ : a = (a != b) & 1; break;
+					case LSS : a = (a < b) & 1; break;
+					case LEQ : a = (a <= b) & 1; break;
+					case GTR : a = (a > b) & 1; break;
+					case GEQ : a = (a >= b) & 1; break;
+					default :
+						result = vm_bad_instruction;
+						goto done;
+				}
+				zeros = lane_zero_count(&a);
+				if (zeros != 0 && zeros != VM_LANES)
+				{
+					batch->peak = peak;
+					split_lanes(batch, bp, sp, pc - 3, io, status);
+					return;
+				}
+				sp -= 2;
+				if (zeros == VM_LANES)
+					pc = ir->m;
+				break;
+			case SYS :
+				switch (ir->m)
+				{
+					case WRT :
+						a = stack[sp--];
+						for (i = 0; i < VM_LANES; i++)
+							io[i].write(io[i].context, a[i]);
+						break;
+					case RED :
+						for (i = 0; i < VM_LANES; i++)
+							a[i] = io[i].read(io[i].context);
+						stack[++sp] = a;
+						break;
+					case HLT :
+						goto done;
+					default :
+						result = vm_bad_instruction;
+						goto done;
+				}
+				break;
+			default :
+				result = vm_bad_instruction;
+				goto done;
+		}
+	}
+
+done:
+	batch->peak = peak;
+	for (i = 0; i < VM_LANES; i++)
+		status[i] = result;
+}
+
+// finishes each lane in the scalar interpreter, from a copy of its column of 
+// 		the shared stack
+void split_lanes(lane_batch *batch, int bp, int sp, int pc, vm_io *io, vm_status *status)
+{
+	vm_instance instance;
+	int cells = batch->peak + batch->stack_depth + 1;
+	int cell;
+	int i;
+
+	for (i = 0; i < VM_LANES; i++)
+	{
+		status[i] = start_program(&instance, batch->code, batch->code_length, batch->stack_depth, 
+			batch->stack_limit, &io[i], NULL);
+		if (status[i] != vm_yielded)
+			continue;
+		for (cell = 0; cell < cells; cell++)
+			instance.stack[cell] = batch->stack[cell][i];
+		instance.bp = bp;
+		instance.sp = sp;
+		instance.pc = pc;
+		status[i] = resume_program(&instance, -1);
+		finish_program(&instance);
+	}
+}
+
+// grow_stack() for the shared stack, vectors need aligned memory so it 
+// 		copies rather than reallocs
+bool grow_lanes(lane_batch *batch, int top)
+{
+	int limit = batch->stack_limit;
+	int cells = batch->stack_limit + batch->stack_depth + 1;
+	lane_vector *stack;
+
+	if (top >= VM_STACK_SIZE)
+		return false;
+	while (limit <= top)
+		limit = limit * 2 > VM_STACK_SIZE ? VM_STACK_SIZE : limit * 2;
+	stack = aligned_alloc(sizeof(lane_vector), (limit + batch->stack_depth + 1) * sizeof(lane_vector));
+	if (stack == NULL)
+		return false;
+	memcpy(stack, batch->stack, cells * sizeof(lane_vector));
+	memset(stack + cells, 0, (limit - batch->stack_limit) * sizeof(lane_vector));
+	free(batch->stack);
+	batch->stack = stack;
+	batch->stack_limit = limit;
+	return true;
+}
+
+int lane_zero_count(const lane_vector *value)
+{
+	int zeros = 0;
+	int i;
+
+	for (i = 0; i < VM_LANES; i++)
+		zeros += (*value)[i] == 0;
+	return zeros;
+}
+
+// base() for the shared stack, every lane holds the same links
+int lane_base(lane_vector *stack, int bp, int l)
+{
+	while (l > 0)
+	{
+		bp = stack[bp][0];
+		l--;
+	}
+	return bp;
+}
+#endif
+
+const char *vm_status_message(vm_status status)
+{
+	switch (status)
+	{
+		case vm_halted :
+			return "halted";
+		case vm_stack_overflow :
+			return "Runtime Error: stack overflow";
+		case vm_division_by_zero :
+			return "Runtime Error: division by zero";
+		case vm_bad_instruction :
+			return "Runtime Error: invalid instruction";
+		case vm_unsupported :
+			return "Runtime Error: instruction not supported by this engine";
+		case vm_yielded :
+			return "yielded";
+		default :
+			return "Implementation Error: unrecognized status";
+	}
+}
+
+#ifdef JIT_AVAILABLE
+
+// x86-64 translation. the VM registers live in callee saved registers for
+// 		the whole run:
+// 	rbx  stack cells (int32)
+// 	r12  bp
+// 	r13  sp
+// 	r14  native address of every PAS address, used to return from calls
+// 	r15  jit_context
+// static links are walked with an unrolled chain of loads since L is known
+// when translating, and frame-local accesses index straight off r12. LIT and
+// LOD feeding a STO or an arithmetic OPR keep their value in a register
+// instead of going through the stack, and a LIT of a power of two feeding 
+// MUL or DIV becomes a shift. like the interpreter it only checks 
+// the limit when a frame is pushed or grown, operands spill into the 
+// stack_depth cells above it
+vm_status jit_run_program(const instruction *code, int code_length, int stack_depth, vm_io *io)
+{
+	jit_buffer buffer;
+	jit_fixup *fixups;
+	int fixup_count = 0;
+	int *native_offset;
+	bool *is_target;
+	void **dispatch = NULL;
+	int *stack;
+	jit_context context;
+	size_t capacity = 256;
+	int overflow_stub;
+	int division_stub;
+	int bad_stub;
+	int epilogue;
+	int i;
+	vm_status status;
+	static const unsigned char jump_unless[] = {
+		[EQL] = 0x85, [NEQ] = 0x84, [LSS] = 0x8d, [LEQ] = 0x8f, [GTR] = 0x8e, [GEQ] = 0x8c
+	};
+
+	if (stack_depth < 0)
+		stack_depth = operand_stack_depth(code, code_length, NULL);
+	if (stack_depth < 0)
+		return vm_bad_instruction;
+
+	// translated size is bounded by the longest sequence per instruction
+	for (i = 0; i < code_length; i++)
+		capacity += 96 + 8 * (code[i].l > 0 ? code[i].l : 0);
+
+	buffer.bytes = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer.bytes == MAP_FAILED)
+		return vm_unsupported;
+	buffer.length = 0;
+	fixups = malloc((2 * code_length + 1) * sizeof(jit_fixup));
+	native_offset = malloc((code_length + 1) * sizeof(int));
+	is_target = calloc(code_length + 1, sizeof(bool));
+	if (fixups == NULL || native_offset == NULL || is_target == NULL)
+		goto unsupported;
+
+	// anything control can land on has to start its own native sequence
+	for (i = 0; i < code_length; i++)
+	{
+		if ((code[i].op == JMP || code[i].op == JPC || code[i].op == CJP || code[i].op == CAL || 
+			code[i].op == TCL) && code[i].m / 3 >= 0 && code[i].m / 3 < code_length)
+			is_target[code[i].m / 3] = true;
+		if (code[i].op == CAL)
+			is_target[i + 1] = true;
+	}
+
+	// prologue: save callee saved registers, rsp ends up 16 byte aligned
+	jit_bytes(&buffer, "\x53\x41\x54\x41\x55\x41\x56\x41\x57", 9);
+	jit_bytes(&buffer, "\x48\x89\xfb", 3);                  // mov rbx, rdi
+	jit_bytes(&buffer, "\x49\x89\xf6", 3);                  // mov r14, rsi
+	jit_bytes(&buffer, "\x49\x89\xd7", 3);                  // mov r15, rdx
+	jit_bytes(&buffer, "\x45\x31\xe4", 3);                  // xor r12d, r12d
+	jit_bytes(&buffer, "\x49\xc7\xc5\xff\xff\xff\xff", 7);  // mov r13, -1
+
+	for (i = 0; i < code_length; i++)
+	{
+		const instruction *ir = &code[i];
+		const instruction *next = i + 1 < code_length && !is_target[i + 1] ? &code[i + 1] : NULL;
+		native_offset[i] = buffer.length;
+
+		switch (ir->op)
+		{
+			case LIT :
+				if (next != NULL && (next->op == STO || next->op == STG))
+				{
+					// mov dword [frame + m], imm32
+					jit_operand_address(&buffer, jit_frame_distance(next), 0xc7, 0, next->m);
+					jit_int32(&buffer, ir->m);
+					native_offset[++i] = buffer.length;
+				}
+				else if (next != NULL && next->op == OPR && (next->m == MUL || next->m == DIV) && 
+					jit_power_of_two(ir->m) >= 0)
+				{
+					jit_shift_operation(&buffer, next->m, jit_power_of_two(ir->m));
+					native_offset[++i] = buffer.length;
+				}
+				else if (next != NULL && next->op == OPR && next->m != RTN)
+				{
+					jit_byte(&buffer, 0xb8);                // mov eax, imm32
+					jit_int32(&buffer, ir->m);
+					if (!jit_binary_operation(&buffer, next->m, fixups, &fixup_count))
+						goto unsupported;
+					native_offset[++i] = buffer.length;
+				}
+				else
+				{
+					jit_bytes(&buffer, "\x49\xff\xc5", 3);  // inc r13
+					jit_bytes(&buffer, "\x42\xc7\x04\xab", 4);  // mov dword [rbx + r13 * 4], imm32
+					jit_int32(&buffer, ir->m);
+				}
+				break;
+			case LOD :
+			case LDG :
+				if (next != NULL && (next->op == STO || next->op == STG))
+				{
+					jit_operand_address(&buffer, jit_frame_distance(ir), 0x8b, 1, ir->m);   // mov ecx, [frame + m]
+					jit_operand_address(&buffer, jit_frame_distance(next), 0x89, 1, next->m);   // mov [frame + m], ecx
+					native_offset[++i] = buffer.length;
+				}
+				else if (next != NULL && next->op == OPR && next->m != RTN)
+				{
+					jit_operand_address(&buffer, jit_frame_distance(ir), 0x8b, 0, ir->m);   // mov eax, [frame + m]
+					if (!jit_binary_operation(&buffer, next->m, fixups, &fixup_count))
+						goto unsupported;
+					native_offset[++i] = buffer.length;
+				}
+				else
+				{
+					jit_operand_address(&buffer, jit_frame_distance(ir), 0x8b, 1, ir->m);   // mov ecx, [frame + m]
+					jit_bytes(&buffer, "\x49\xff\xc5", 3);  // inc r13
+					jit_bytes(&buffer, "\x42\x89\x0c\xab", 4);  // mov [rbx + r13 * 4], ecx
+				}
+				break;
+			case SIM :
+			case RDS :
+			case CPY :
+				if (i + 1 >= code_length)
+					goto unsupported;
+				next = &code[i + 1];
+				if (ir->op == SIM)
+				{
+					// mov dword [frame + m], imm32
+					jit_operand_address(&buffer, jit_frame_distance(next), 0xc7, 0, next->m);
+					jit_int32(&buffer, ir->m);
+				}
+				else if (ir->op == RDS)
+				{
+					jit_bytes(&buffer, "\x4c\x89\xff", 3);  // mov rdi, r15
+					jit_bytes(&buffer, "\x48\xb8", 2);      // mov rax, jit_read
+					jit_int64(&buffer, (int64_t) (intptr_t) jit_read);
+					jit_bytes(&buffer, "\xff\xd0", 2);      // call rax
+					jit_bytes(&buffer, "\x89\xc1", 2);      // mov ecx, eax
+					jit_operand_address(&buffer, jit_frame_distance(next), 0x89, 1, next->m);   // mov [frame + m], ecx
+				}
+				else
+				{
+					jit_operand_address(&buffer, ir->l, 0x8b, 1, ir->m);   // mov ecx, [frame + m]
+					jit_operand_address(&buffer, jit_frame_distance(next), 0x89, 1, next->m);   // mov [frame + m], ecx
+				}
+				native_offset[++i] = buffer.length;
+				break;
+			case STO :
+			case STG :
+				jit_bytes(&buffer, "\x42\x8b\x0c\xab", 4);  // mov ecx, [rbx + r13 * 4]
+				jit_operand_address(&buffer, jit_frame_distance(ir), 0x89, 1, ir->m);   // mov [frame + m], ecx
+				jit_bytes(&buffer, "\x49\xff\xcd", 3);  // dec r13
+				break;
+			case CAL :
+				jit_bytes(&buffer, "\x4d\x3b\x6f\x08", 4);  // cmp r13, [r15 + limit]
+				jit_bytes(&buffer, "\x0f\x8d", 2);      // jge overflow
+				fixups[fixup_count].position = buffer.length;
+				fixups[fixup_count++].target = -1;
+				jit_int32(&buffer, 0);
+				jit_base(&buffer, ir->l);
+				jit_bytes(&buffer, "\x42\x89\x44\xab\x04", 5);  // mov [rbx + r13 * 4 + 4], eax
+				jit_bytes(&buffer, "\x46\x89\x64\xab\x08", 5);  // mov [rbx + r13 * 4 + 8], r12d
+				jit_bytes(&buffer, "\x42\xc7\x44\xab\x0c", 5);  // mov dword [rbx + r13 * 4 + 12], imm32
+				jit_int32(&buffer, (i + 1) * 3);
+				jit_bytes(&buffer, "\x4d\x8d\x65\x01", 4);  // lea r12, [r13 + 1]
+				jit_byte(&buffer, 0xe9);                // jmp target
+				fixups[fixup_count].position = buffer.length;
+				fixups[fixup_count++].target = ir->m / 3;
+				jit_int32(&buffer, 0);
+				break;
+			case TCL :
+				jit_base(&buffer, ir->l);
+				jit_bytes(&buffer, "\x42\x89\x04\xa3", 4);  // mov [rbx + r12 * 4], eax
+				jit_bytes(&buffer, "\x4d\x8d\x6c\x24\xff", 5);  // lea r13, [r12 - 1]
+				jit_byte(&buffer, 0xe9);                // jmp target
+				fixups[fixup_count].position = buffer.length;
+				fixups[fixup_count++].target = ir->m / 3;
+				jit_int32(&buffer, 0);
+				break;
+			case INC :
+				jit_bytes(&buffer, "\x49\x81\xc5", 3);  // add r13, imm32
+				jit_int32(&buffer, ir->m);
+				jit_bytes(&buffer, "\x4d\x3b\x6f\x08", 4);  // cmp r13, [r15 + limit]
+				jit_bytes(&buffer, "\x0f\x8d", 2);      // jge overflow
+				fixups[fixup_count].position = buffer.length;
+				fixups[fixup_count++].target = -1;
+				jit_int32(&buffer, 0);
+				break;
+			case JMP :
+				jit_byte(&buffer, 0xe9);                // jmp target
+				fixups[fixup_count].position = buffer.length;
+				fixups[fixup_count++].target = ir->m / 3;
+				jit_int32(&buffer, 0);
+				break;
+			case JPC :
+				jit_bytes(&buffer, "\x42\x8b\x04\xab", 4);  // mov eax, [rbx + r13 * 4]
+				jit_bytes(&buffer, "\x49\xff\xcd", 3);  // dec r13
+				jit_bytes(&buffer, "\x85\xc0", 2);      // test eax, eax
+				jit_bytes(&buffer, "\x0f\x84", 2);      // jz target
+				fixups[fixup_count].position = buffer.length;
+				fixups[fixup_count++].target = ir->m / 3;
+				jit_int32(&buffer, 0);
+				break;
+			case CJP :
+				if (ir->l < EQL || ir->l > GEQ)
+					goto unsupported;
+				jit_bytes(&buffer, "\x42\x8b\x04\xab", 4);  // mov eax, [rbx + r13 * 4]
+				jit_bytes(&buffer, "\x42\x8b\x4c\xab\xfc", 5);  // mov ecx, [rbx + r13 * 4 - 4]
+				jit_bytes(&buffer, "\x49\x83\xed\x02", 4);  // sub r13, 2
+				jit_bytes(&buffer, "\x39\xc1", 2);      // cmp ecx, eax
+				jit_byte(&buffer, 0x0f);                // jcc target, taken when the relation is false
+				jit_byte(&buffer, jump_unless[ir->l]);
+				fixups[fixup_count].position = buffer.length;
+				fixups[fixup_count++].target = ir->m / 3;
+				jit_int32(&buffer, 0);
+				break;
+			case OPR :
+				if (ir->m == RTN)
+				{
+					jit_bytes(&buffer, "\x4a\x63\x44\xa3\x08", 5);  // movsxd rax, [rbx + r12 * 4 + 8]
+					jit_bytes(&buffer, "\x4d\x8d\x6c\x24\xff", 5);  // lea r13, [r12 - 1]
+					jit_bytes(&buffer, "\x4e\x63\x64\xa3\x04", 5);  // movsxd r12, [rbx + r12 * 4 + 4]
+					jit_bytes(&buffer, "\x41\xff\x24\xc6", 4);  // jmp [r14 + rax * 8]
+					break;
+				}
+				jit_bytes(&buffer, "\x42\x8b\x04\xab", 4);  // mov eax, [rbx + r13 * 4]
+				jit_bytes(&buffer, "\x49\xff\xcd", 3);  // dec r13
+				if (!jit_binary_operation(&buffer, ir->m, fixups, &fixup_count))
+					goto unsupported;
+				break;
+			case SYS :
+				if (ir->m == WRT)
+				{
+					jit_bytes(&buffer, "\x42\x8b\x34\xab", 4);  // mov esi, [rbx + r13 * 4]
+					jit_bytes(&buffer, "\x49\xff\xcd", 3);  // dec r13
+					jit_bytes(&buffer, "\x4c\x89\xff", 3);  // mov rdi, r15
+					jit_bytes(&buffer, "\x48\xb8", 2);      // mov rax, jit_write
+					jit_int64(&buffer, (int64_t) (intptr_t) jit_write);
+					jit_bytes(&buffer, "\xff\xd0", 2);      // call rax
+				}
+				else if (ir->m == RED)
+				{
+					jit_bytes(&buffer, "\x4c\x89\xff", 3);  // mov rdi, r15
+					jit_bytes(&buffer, "\x48\xb8", 2);      // mov rax, jit_read
+					jit_int64(&buffer, (int64_t) (intptr_t) jit_read);
+					jit_bytes(&buffer, "\xff\xd0", 2);      // call rax
+					jit_bytes(&buffer, "\x49\xff\xc5", 3);  // inc r13
+					jit_bytes(&buffer, "\x42\x89\x04\xab", 4);  // mov [rbx + r13 * 4], eax
+				}
+				else if (ir->m == HLT)
+				{
+					jit_bytes(&buffer, "\x31\xc0", 2);      // xor eax, eax
+					jit_byte(&buffer, 0xe9);                // jmp epilogue
+					fixups[fixup_count].position = buffer.length;
+					fixups[fixup_count++].target = -2;
+					jit_int32(&buffer, 0);
+				}
+				else
+					goto unsupported;
+				break;
+			default :
+				goto unsupported;
+		}
+	}
+	native_offset[code_length] = buffer.length;
+
+	// running off the end is the same as an invalid instruction
+	bad_stub = buffer.length;
+	jit_byte(&buffer, 0xb8);
+	jit_int32(&buffer, vm_bad_instruction);
+	jit_bytes(&buffer, "\xeb\x0c", 2);                      // jmp epilogue
+	overflow_stub = buffer.length;
+	jit_byte(&buffer, 0xb8);
+	jit_int32(&buffer, vm_stack_overflow);
+	jit_bytes(&buffer, "\xeb\x05", 2);                      // jmp epilogue
+	division_stub = buffer.length;
+	jit_byte(&buffer, 0xb8);
+	jit_int32(&buffer, vm_division_by_zero);
+	epilogue = buffer.length;
+	jit_bytes(&buffer, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\xc3", 10);
+
+	// patch the rel32 displacements now that every offset is known
+	for (i = 0; i < fixup_count; i++)
+	{
+		int target;
+		int32_t displacement;
+		if (fixups[i].target == -1)
+			target = overflow_stub;
+		else if (fixups[i].target == -2)
+			target = epilogue;
+		else if (fixups[i].target == -3)
+			target = division_stub;
+		else if (fixups[i].target < 0 || fixups[i].target >= code_length)
+			target = bad_stub;
+		else
+			target = native_offset[fixups[i].target];
+		displacement = target - (fixups[i].position + 4);
+		memcpy(buffer.bytes + fixups[i].position, &displacement, 4);
+	}
+
+	// return addresses are PAS addresses, so index the table by those
+	dispatch = malloc((code_length * 3 + 3) * sizeof(void *));
+	if (dispatch == NULL)
+		goto unsupported;
+	for (i = 0; i < code_length * 3 + 3; i++)
+		dispatch[i] = buffer.bytes + (i % 3 == 0 && i / 3 <= code_length ? native_offset[i / 3] : bad_stub);
+
+	if (mprotect(buffer.bytes, capacity, PROT_READ | PROT_EXEC) != 0)
+		goto unsupported;
+
+	stack = calloc(VM_STACK_SIZE + stack_depth + 1, sizeof(int));
+	context.io = io;
+	context.limit = VM_STACK_SIZE - 3;
+	// no room for the stack is reported the way the interpreter does
+	if (stack == NULL)
+		status = vm_stack_overflow;
+	else
+		status = ((int (*)(int *, void **, jit_context *)) (intptr_t) buffer.bytes)(stack, dispatch, &context);
+
+	free(stack);
+	free(dispatch);
+	free(fixups);
+	free(native_offset);
+	free(is_target);
+	munmap(buffer.bytes, capacity);
+	return status;
+
+unsupported:
+	free(dispatch);
+	free(fixups);
+	free(native_offset);
+	free(is_target);
+	munmap(buffer.bytes, capacity);
+	return vm_unsupported;
+}
+
+// called from translated code for SYS RED and SYS WRT
+int jit_read(jit_context *context)
+{
+	return context->io->read(context->io->context);
+}
+
+void jit_write(jit_context *context, int value)
+{
+	context->io->write(context->io->context, value);
+}
+
+void jit_byte(jit_buffer *buffer, int value)
+{
+	buffer->bytes[buffer->length++] = value;
+}
+
+void jit_bytes(jit_buffer *buffer, const char *bytes, int count)
+{
+	memcpy(buffer->bytes + buffer->length, bytes, count);
+	buffer->length += count;
+}
+
+void jit_int32(jit_buffer *buffer, int value)
+{
+	memcpy(buffer->bytes + buffer->length, &value, 4);
+	buffer->length += 4;
+}
+
+void jit_int64(jit_buffer *buffer, int64_t value)
+{
+	memcpy(buffer->bytes + buffer->length, &value, 8);
+	buffer->length += 8;
+}
+
+// rax = base(l), unrolled since l is a constant
+void jit_base(jit_buffer *buffer, int l)
+{
+	jit_bytes(buffer, "\x4c\x89\xe0", 3);                   // mov rax, r12
+	while (l-- > 0)
+		jit_bytes(buffer, "\x48\x63\x04\x83", 4);           // movsxd rax, [rbx + rax * 4]
+}
+
+// how jit_operand_address() reaches an instruction's variable, -1 for LDG 
+// 		and STG since main's frame starts at cell 0
+int jit_frame_distance(const instruction *ir)
+{
+	return ir->op == LDG || ir->op == STG ? -1 : ir->l;
+}
+
+// emits opcode with a [base(l) + m] memory operand and reg in the reg field,
+// 		l = 0 addresses off r12 directly and skips the static link walk and 
+// 		l = -1 addresses cell m absolutely
+void jit_operand_address(jit_buffer *buffer, int l, int opcode, int reg, int m)
+{
+	if (l == -1)
+	{
+		jit_byte(buffer, opcode);
+		jit_byte(buffer, 0x83 | reg << 3);                      // [rbx + disp32]
+	}
+	else if (l == 0)
+	{
+		jit_byte(buffer, 0x42);                                 // rex.x for r12
+		jit_byte(buffer, opcode);
+		jit_byte(buffer, 0x84 | reg << 3);                      // [base + index * 4 + disp32]
+		jit_byte(buffer, 0xa3);                                 // rbx + r12 * 4
+	}
+	else
+	{
+		jit_base(buffer, l);
+		jit_byte(buffer, opcode);
+		jit_byte(buffer, 0x84 | reg << 3);
+		jit_byte(buffer, 0x83);                                 // rbx + rax * 4
+	}
+	jit_int32(buffer, m * 4);
+}
+
+// eax holds the right operand, the left one stays on top of the stack and is
+// 		replaced by the result
+bool jit_binary_operation(jit_buffer *buffer, int operation, jit_fixup *fixups, int *fixup_count)
+{
+	static const unsigned char setcc[] = {
+		[EQL] = 0x94, [NEQ] = 0x95, [LSS] = 0x9c, [LEQ] = 0x9e, [GTR] = 0x9f, [GEQ] = 0x9d
+	};
+
+	switch (operation)
+	{
+		case ADD :
+			jit_bytes(buffer, "\x42\x01\x04\xab", 4);           // add [rbx + r13 * 4], eax
+			return true;
+		case SUB :
+			jit_bytes(buffer, "\x42\x29\x04\xab", 4);           // sub [rbx + r13 * 4], eax
+			return true;
+		case MUL :
+			jit_bytes(buffer, "\x89\xc1", 2);                   // mov ecx, eax
+			jit_bytes(buffer, "\x42\x8b\x04\xab", 4);           // mov eax, [rbx + r13 * 4]
+			jit_bytes(buffer, "\x0f\xaf\xc1", 3);               // imul eax, ecx
+			jit_bytes(buffer, "\x42\x89\x04\xab", 4);           // mov [rbx + r13 * 4], eax
+			return true;
+		case DIV :
+			jit_bytes(buffer, "\x89\xc1", 2);                   // mov ecx, eax
+			jit_bytes(buffer, "\x85\xc9", 2);                   // test ecx, ecx
+			jit_bytes(buffer, "\x0f\x84", 2);                   // jz division by zero
+			fixups[*fixup_count].position = buffer->length;
+			fixups[(*fixup_count)++].target = -3;
+			jit_int32(buffer, 0);
+			jit_bytes(buffer, "\x42\x8b\x04\xab", 4);           // mov eax, [rbx + r13 * 4]
+			// INT_MIN / -1 would trap in idiv, dividing by -1 is a neg instead
+			jit_bytes(buffer, "\x83\xf9\xff", 3);               // cmp ecx, -1
+			jit_bytes(buffer, "\x75\x04", 2);                   // jne idiv
+			jit_bytes(buffer, "\xf7\xd8", 2);                   // neg eax
+			jit_bytes(buffer, "\xeb\x03", 2);                   // jmp past idiv
+			jit_bytes(buffer, "\x99", 1);                       // cdq
+			jit_bytes(buffer, "\xf7\xf9", 2);                   // idiv ecx
+			jit_bytes(buffer, "\x42\x89\x04\xab", 4);           // mov [rbx + r13 * 4], eax
+			return true;
+		case EQL :
+		case NEQ :
+		case LSS :
+		case LEQ :
+		case GTR :
+		case GEQ :
+			jit_bytes(buffer, "\x42\x8b\x0c\xab", 4);           // mov ecx, [rbx + r13 * 4]
+			jit_bytes(buffer, "\x39\xc1", 2);                   // cmp ecx, eax
+			jit_byte(buffer, 0x0f);                             // setcc al
+			jit_byte(buffer, setcc[operation]);
+			jit_byte(buffer, 0xc0);
+			jit_bytes(buffer, "\x0f\xb6\xc0", 3);               // movzx eax, al
+			jit_bytes(buffer, "\x42\x89\x04\xab", 4);           // mov [rbx + r13 * 4], eax
+			return true;
+		default :
+			return false;
+	}
+}
+
+// log2 of value if it is a power of two, -1 if not
+int jit_power_of_two(int value)
+{
+	int shift = 0;
+
+	if (value <= 0 || (value & (value - 1)) != 0)
+		return -1;
+	while (value >> shift != 1)
+		shift++;
+	return shift;
+}
+
+// multiplies or divides the top of the stack by 1 << shift in place. idiv 
+// 		rounds toward zero, so a negative dividend gets (1 << shift) - 1 
+// 		added before the arithmetic shift to do the same
+void jit_shift_operation(jit_buffer *buffer, int operation, int shift)
+{
+	if (shift == 0)
+		return;
+	if (operation == MUL)
+	{
+		jit_bytes(buffer, "\x42\xc1\x24\xab", 4);               // shl dword [rbx + r13 * 4], imm8
+		jit_byte(buffer, shift);
+		return;
+	}
+	jit_bytes(buffer, "\x42\x8b\x04\xab", 4);                   // mov eax, [rbx + r13 * 4]
+	jit_bytes(buffer, "\x89\xc1", 2);                           // mov ecx, eax
+	jit_bytes(buffer, "\xc1\xf9\x1f", 3);                       // sar ecx, 31
+	jit_bytes(buffer, "\xc1\xe9", 2);                           // shr ecx, imm8
+	jit_byte(buffer, 32 - shift);
+	jit_bytes(buffer, "\x01\xc8", 2);                           // add eax, ecx
+	jit_bytes(buffer, "\xc1\xf8", 2);                           // sar eax, imm8
+	jit_byte(buffer, shift);
+	jit_bytes(buffer, "\x42\x89\x04\xab", 4);                   // mov [rbx + r13 * 4], eax
+}
+
+#else
+
+// no native backend on this platform, callers fall back to run_program()
+vm_status jit_run_program(const instruction *code, int code_length, int stack_depth, vm_io *io)
+{
+	(void) code;
+	(void) code_length;
+	(void) stack_depth;
+	(void) io;
+	return vm_unsupported;
+}
+
+#endif